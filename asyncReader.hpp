@@ -0,0 +1,428 @@
+#pragma once
+
+#include <vector>
+#include <string_view>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "automaton.hpp"
+
+// Turns chunks of a stream, taken in order, into runs of complete records
+// as RecordReader hands them out. Records are passed straight out of the
+// chunk they were read into; only one that straddles two chunks is copied,
+// into carry, to be finished by the next.
+class RecordJoiner
+{
+private:
+    std::vector<char> carry;
+    uint64_t carryOffset = 0;
+    uint64_t offset = 0;
+
+public:
+    // Offsets handed out count from at, the start of the stream by default
+    // as with RecordReader, wherever in the file reading began.
+    void start(uint64_t at = 0)
+    {
+        carry.clear();
+        carryOffset = offset = at;
+    }
+
+    // Returns false once onRecords does.
+    template <typename OnRecords>
+    bool add(std::string_view chunk, OnRecords &onRecords)
+    {
+        size_t from = 0;
+        if (!carry.empty())
+        {
+            size_t nl = chunk.find(recordSeparator);
+            if (nl == std::string_view::npos)
+            {
+                carry.insert(carry.end(), chunk.begin(), chunk.end());
+                offset += chunk.size();
+                return true;
+            }
+            carry.insert(carry.end(), chunk.begin(), chunk.begin() + nl + 1);
+            if (!onRecords(std::string_view(carry.data(), carry.size()), carryOffset))
+                return false;
+            carry.clear();
+            from = nl + 1;
+        }
+        size_t last = chunk.rfind(recordSeparator);
+        if (last != std::string_view::npos && last >= from)
+        {
+            if (!onRecords(chunk.substr(from, last + 1 - from), offset + from))
+                return false;
+            from = last + 1;
+        }
+        carryOffset = offset + from;
+        carry.assign(chunk.begin() + from, chunk.end());
+        offset += chunk.size();
+        return true;
+    }
+
+    // The last record, when the stream doesn't end with a '\n'.
+    template <typename OnRecords>
+    void finish(OnRecords &onRecords)
+    {
+        if (!carry.empty())
+            onRecords(std::string_view(carry.data(), carry.size()), carryOffset);
+        carry.clear();
+    }
+};
+
+// Reads a regular file through io_uring with depth fixed-size buffers in
+// flight, registered with the ring once so the kernel doesn't map them
+// again for every read. The records of one chunk are matched while the
+// reads of the next ones are under way. Talks to the kernel directly, as
+// only its header is needed; available() is false where the kernel or a
+// sandbox refuses the ring.
+class UringReader
+{
+private:
+    struct Slot
+    {
+        uint64_t offset = 0;
+        size_t filled = 0;
+        bool done = false;
+        int error = 0;
+    };
+
+    int ring = -1;
+    void *sqRing = MAP_FAILED;
+    void *cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    size_t sqesSize = 0;
+    unsigned *sqTail = nullptr;
+    unsigned *sqMask = nullptr;
+    unsigned *sqArray = nullptr;
+    unsigned *cqHead = nullptr;
+    unsigned *cqTail = nullptr;
+    unsigned *cqMask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    size_t chunkSize;
+    unsigned depth;
+    char *buffers = static_cast<char *>(MAP_FAILED);
+    bool fixed = false;
+    std::vector<Slot> slots;
+    unsigned unsubmitted = 0;
+    unsigned inFlight = 0;
+    int fd = -1;
+
+    static int enter(int ring, unsigned toSubmit, unsigned minComplete)
+    {
+        return static_cast<int>(
+            syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, IORING_ENTER_GETEVENTS, nullptr, 0));
+    }
+
+    char *buffer(unsigned slot) const
+    {
+        return buffers + static_cast<size_t>(slot) * chunkSize;
+    }
+
+    // Queues the rest of slot's chunk; sent to the kernel by the next wait().
+    void submit(unsigned slot)
+    {
+        Slot &s = slots[slot];
+        unsigned tail = *sqTail;
+        unsigned index = tail & *sqMask;
+        io_uring_sqe &sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.off = s.offset + s.filled;
+        sqe.addr = reinterpret_cast<uint64_t>(buffer(slot) + s.filled);
+        sqe.len = static_cast<uint32_t>(chunkSize - s.filled);
+        sqe.buf_index = static_cast<uint16_t>(slot);
+        sqe.user_data = slot;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted++;
+        inFlight++;
+    }
+
+    // A short read that isn't at the end of the file is carried on from
+    // where it stopped, so a chunk is done only when full or at the end.
+    void reap()
+    {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const io_uring_cqe &cqe = cqes[head & *cqMask];
+            Slot &s = slots[cqe.user_data];
+            inFlight--;
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+            {
+                submit(cqe.user_data);
+            }
+            else if (cqe.res < 0)
+            {
+                s.error = -cqe.res;
+                s.done = true;
+            }
+            else
+            {
+                s.filled += cqe.res;
+                if (cqe.res == 0 || s.filled == chunkSize)
+                    s.done = true;
+                else
+                    submit(cqe.user_data);
+            }
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // Submits what is queued and waits for at least one completion.
+    bool wait()
+    {
+        int n = enter(ring, unsubmitted, 1);
+        if (n < 0 && errno != EINTR)
+            return false;
+        if (n > 0)
+            unsubmitted -= std::min<unsigned>(n, unsubmitted);
+        reap();
+        return true;
+    }
+
+    void start(unsigned slot, uint64_t offset)
+    {
+        slots[slot] = Slot();
+        slots[slot].offset = offset;
+        submit(slot);
+    }
+
+public:
+    UringReader(size_t chunkSize = 1 << 20, unsigned depth = 4) : chunkSize(chunkSize), depth(depth), slots(depth)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+        if (ring < 0)
+            return;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                      IORING_OFF_SQ_RING);
+        cqRing = single ? sqRing
+                        : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                               IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(
+            mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+        buffers = static_cast<char *>(
+            mmap(nullptr, chunkSize * depth, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED || buffers == MAP_FAILED)
+        {
+            close(ring);
+            ring = -1;
+            return;
+        }
+
+        auto sq = static_cast<char *>(sqRing);
+        sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        auto cq = static_cast<char *>(cqRing);
+        cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        // Without registered buffers, as under a low RLIMIT_MEMLOCK, plain
+        // reads into the same buffers still overlap.
+        std::vector<iovec> iovecs(depth);
+        for (unsigned i = 0; i < depth; i++)
+            iovecs[i] = {buffer(i), chunkSize};
+        fixed = syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS, iovecs.data(), depth) == 0;
+    }
+
+    UringReader(const UringReader &) = delete;
+    UringReader &operator=(const UringReader &) = delete;
+
+    ~UringReader()
+    {
+        // Closing the ring waits for reads still in flight to finish.
+        if (ring >= 0)
+            close(ring);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (buffers != MAP_FAILED)
+            munmap(buffers, chunkSize * depth);
+    }
+
+    bool available() const
+    {
+        return ring >= 0;
+    }
+
+    // Reads fd, a regular file, from offset to its end as RecordReader::read
+    // does. Every read still in flight is waited for before returning, so
+    // the buffers are free for the next file.
+    template <typename OnRecords>
+    bool read(int fd, uint64_t offset, RecordJoiner &joiner, OnRecords &onRecords)
+    {
+        this->fd = fd;
+        joiner.start();
+        for (unsigned i = 0; i < depth; i++)
+            start(i, offset + i * chunkSize);
+
+        bool ok = true;
+        bool stopped = false;
+        for (uint64_t chunk = 0;; chunk++)
+        {
+            unsigned slot = chunk % depth;
+            while (!slots[slot].done && (ok = wait()))
+            {
+            }
+            if (!ok || slots[slot].error != 0)
+            {
+                ok = false;
+                break;
+            }
+            const Slot &s = slots[slot];
+            bool end = s.filled < chunkSize;
+            if (!joiner.add(std::string_view(buffer(slot), s.filled), onRecords))
+            {
+                stopped = true;
+                break;
+            }
+            if (end)
+                break;
+            start(slot, s.offset + depth * chunkSize);
+        }
+
+        while (inFlight != 0 && wait())
+        {
+        }
+        if (inFlight != 0)
+        {
+            // The ring can't be waited on; only a new one is safe to use.
+            close(ring);
+            ring = -1;
+        }
+        if (ok && !stopped)
+            joiner.finish(onRecords);
+        return ok;
+    }
+};
+
+// Reads ahead of the matcher on a thread of its own, into depth buffers
+// taken in turn, where io_uring can't be used.
+class PrefetchReader
+{
+private:
+    struct Slot
+    {
+        std::vector<char> data;
+        ssize_t filled = 0;
+        bool full = false;
+    };
+
+    size_t chunkSize;
+    std::vector<Slot> slots;
+    std::mutex lock;
+    std::condition_variable changed;
+    bool stop = false;
+
+public:
+    PrefetchReader(size_t chunkSize = 1 << 20, unsigned depth = 4) : chunkSize(chunkSize), slots(depth)
+    {
+        for (auto &s : slots)
+            s.data.resize(chunkSize);
+    }
+
+    template <typename OnRecords>
+    bool read(int fd, uint64_t offset, RecordJoiner &joiner, OnRecords &onRecords)
+    {
+        joiner.start();
+        for (auto &s : slots)
+            s.full = false;
+        stop = false;
+
+        std::thread reader([&]()
+                           {
+                               for (size_t chunk = 0;; chunk++)
+                               {
+                                   Slot &s = slots[chunk % slots.size()];
+                                   {
+                                       std::unique_lock<std::mutex> guard(lock);
+                                       changed.wait(guard, [&]
+                                                    { return !s.full || stop; });
+                                       if (stop)
+                                           return;
+                                   }
+                                   ssize_t n;
+                                   size_t filled = 0;
+                                   while (filled < chunkSize &&
+                                          ((n = pread(fd, s.data.data() + filled, chunkSize - filled, offset + filled)) > 0 ||
+                                           (n < 0 && errno == EINTR)))
+                                   {
+                                       filled += n > 0 ? n : 0;
+                                   }
+                                   offset += filled;
+                                   std::lock_guard<std::mutex> guard(lock);
+                                   s.filled = n < 0 ? -1 : static_cast<ssize_t>(filled);
+                                   s.full = true;
+                                   changed.notify_all();
+                                   if (n <= 0 || filled < chunkSize)
+                                       return;
+                               } });
+
+        bool ok = true;
+        bool stopped = false;
+        for (size_t chunk = 0;; chunk++)
+        {
+            Slot &s = slots[chunk % slots.size()];
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]
+                             { return s.full; });
+            }
+            if (s.filled < 0)
+            {
+                ok = false;
+                break;
+            }
+            if (!joiner.add(std::string_view(s.data.data(), s.filled), onRecords))
+            {
+                stopped = true;
+                break;
+            }
+            if (static_cast<size_t>(s.filled) < chunkSize)
+                break;
+            std::lock_guard<std::mutex> guard(lock);
+            s.full = false;
+            changed.notify_all();
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+            changed.notify_all();
+        }
+        reader.join();
+        if (ok && !stopped)
+            joiner.finish(onRecords);
+        return ok;
+    }
+};
@@ -0,0 +1,503 @@
+#pragma once
+
+#include <bitset>
+#include <vector>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include "prefilter.hpp"
+
+// Thompson NFA lowered from the AST, matched through a lazily built DFA.
+//
+// Input is treated as a sequence of records separated by '\n' (a single
+// line read from stdin is one record). No byte set ever contains '\n', and
+// a '\n' lookahead behaves exactly like end of text, so one record never
+// leaks into the next and a buffer holding many lines can be scanned in
+// one pass.
+
+const unsigned char recordSeparator = '\n';
+
+struct NfaState
+{
+    enum struct Type
+    {
+        Byte,
+        Split,
+        NotFollowedBy,
+        AtEnd,
+        Match
+    };
+
+    Type type;
+    std::bitset<256> bytes = {};
+    int out = -1;
+    int out1 = -1;
+};
+
+struct Nfa
+{
+    // Patterns that would lower to more states are left to the tree walker.
+    static const size_t maxStates = 1 << 18;
+
+    std::vector<NfaState> states;
+    int start = -1;
+
+    int add(NfaState state)
+    {
+        states.push_back(state);
+        return states.size() - 1;
+    }
+
+    int addByte(std::bitset<256> bytes, int out)
+    {
+        bytes.reset(recordSeparator);
+        return add({.type = NfaState::Type::Byte, .bytes = bytes, .out = out});
+    }
+
+    int addSplit(int out, int out1)
+    {
+        return add({.type = NfaState::Type::Split, .out = out, .out1 = out1});
+    }
+
+    // Continue only if the next byte is not one of bytes: a possessive
+    // repetition, or the shorter operand of a + the longer one beats.
+    int addNotFollowedBy(std::bitset<256> bytes, int out)
+    {
+        bytes.reset(recordSeparator);
+        return add({.type = NfaState::Type::NotFollowedBy, .bytes = bytes, .out = out});
+    }
+
+    int addAtEnd(int out)
+    {
+        return add({.type = NfaState::Type::AtEnd, .out = out});
+    }
+
+    int addMatch()
+    {
+        return add({.type = NfaState::Type::Match});
+    }
+
+    static std::bitset<256> byteSet(unsigned char c, bool ignoreCase)
+    {
+        std::bitset<256> set;
+        set.set(c);
+        if (ignoreCase)
+        {
+            set.set(std::tolower(c));
+            set.set(std::toupper(c));
+        }
+        return set;
+    }
+
+    static std::bitset<256> anyByte()
+    {
+        return std::bitset<256>().set();
+    }
+
+    // The same automaton read right to left, to find where a match ending
+    // at a known point starts. State i of the result is state i here,
+    // reached from the end instead: it starts at the Match state and
+    // matches on reaching start. A condition on the next byte becomes one
+    // on the byte read last, which is the same byte of the text.
+    Nfa reversed() const
+    {
+        Nfa r;
+        if (start < 0)
+            return r;
+        r.states.resize(states.size(), {.type = NfaState::Type::Split});
+        std::vector<std::vector<int>> into(states.size());
+        for (size_t i = 0; i < states.size(); i++)
+        {
+            const NfaState &s = states[i];
+            int from = static_cast<int>(i);
+            if (s.type == NfaState::Type::Match)
+                r.start = from;
+            else if (s.type == NfaState::Type::Split)
+            {
+                for (int to : {s.out, s.out1})
+                {
+                    if (to >= 0)
+                        into[to].push_back(from);
+                }
+            }
+            else if (s.out >= 0)
+            {
+                int edge = s.type == NfaState::Type::NotFollowedBy ? r.addNotFollowedBy(s.bytes, from)
+                           : s.type == NfaState::Type::AtEnd       ? r.addAtEnd(from)
+                                                                   : r.addByte(s.bytes, from);
+                into[s.out].push_back(edge);
+            }
+        }
+        into[start].push_back(r.addMatch());
+
+        // Each state goes on to every state that led to it, or nowhere.
+        for (size_t i = 0; i < into.size(); i++)
+        {
+            auto &edges = into[i];
+            if (edges.empty())
+            {
+                r.states[i].type = NfaState::Type::Byte;
+                continue;
+            }
+            int rest = edges.back();
+            for (size_t j = edges.size() - 1; j-- > 1;)
+                rest = r.addSplit(edges[j], rest);
+            r.states[i].out = edges.front();
+            r.states[i].out1 = edges.size() > 1 ? rest : -1;
+        }
+        return r;
+    }
+};
+
+struct DfaState
+{
+    std::vector<int> kernel;
+    DfaState *next[256] = {};
+    std::bitset<256> accepts;
+    bool mayAccept = false;
+    bool isStart = false;
+    bool isDead = false;
+    // Whether a new thread starts at every byte.
+    bool seeds = false;
+};
+
+class Dfa
+{
+public:
+    enum struct Mode
+    {
+        // One thread from the start.
+        Anchored,
+        // A thread starts at every byte until one matches, kept in the
+        // order of where they started; a match drops the later ones.
+        Leftmost,
+        // Anchored, over a reversed Nfa read right to left: a condition
+        // is on the byte read last, so states are closed when entered.
+        Reverse
+    };
+
+private:
+    static const size_t maxStates = 4096;
+
+    const Nfa *nfa;
+    Mode mode;
+    std::map<std::vector<int>, DfaState *> cache;
+    std::vector<std::unique_ptr<DfaState>> states;
+    std::vector<std::unique_ptr<DfaState>> retired;
+    DfaState *start = nullptr;
+    DfaState *reverseStarts[256] = {};
+    std::vector<int> stack;
+    std::vector<bool> onStack;
+    size_t bytes = 0;
+
+    // The Byte and Match states reached from kernel, in the order of the
+    // kernel's states.
+    void closure(const std::vector<int> &kernel, unsigned char lookahead, std::vector<int> &out)
+    {
+        bool atEnd = lookahead == recordSeparator;
+        std::fill(onStack.begin(), onStack.end(), false);
+        stack.assign(kernel.rbegin(), kernel.rend());
+        while (!stack.empty())
+        {
+            int id = stack.back();
+            stack.pop_back();
+            if (id < 0 || onStack[id])
+                continue;
+            onStack[id] = true;
+            const NfaState &s = nfa->states[id];
+            switch (s.type)
+            {
+            case NfaState::Type::Split:
+                stack.push_back(s.out1);
+                stack.push_back(s.out);
+                break;
+            case NfaState::Type::NotFollowedBy:
+                if (atEnd || !s.bytes.test(lookahead))
+                    stack.push_back(s.out);
+                break;
+            case NfaState::Type::AtEnd:
+                if (atEnd)
+                    stack.push_back(s.out);
+                break;
+            default:
+                out.push_back(id);
+                break;
+            }
+        }
+    }
+
+    DfaState *intern(std::vector<int> kernel, bool seeds)
+    {
+        if (mode == Mode::Leftmost)
+        {
+            // Order is priority here. A thread reaching a state an earlier
+            // started one is in adds nothing.
+            if (seeds)
+                kernel.push_back(nfa->start);
+            std::fill(onStack.begin(), onStack.end(), false);
+            auto seen = [&](int id)
+            {
+                if (id < 0)
+                    return true;
+                bool was = onStack[id];
+                onStack[id] = true;
+                return was;
+            };
+            kernel.erase(std::remove_if(kernel.begin(), kernel.end(), seen), kernel.end());
+        }
+        else
+        {
+            std::sort(kernel.begin(), kernel.end());
+            kernel.erase(std::unique(kernel.begin(), kernel.end()), kernel.end());
+        }
+
+        std::vector<int> key = kernel;
+        key.push_back(seeds);
+        auto found = cache.find(key);
+        if (found != cache.end())
+            return found->second;
+
+        if (states.size() >= maxStates)
+        {
+            // Keep retired states alive until the current search returns,
+            // callers may still hold pointers into them.
+            for (auto &s : states)
+                retired.push_back(std::move(s));
+            states.clear();
+            cache.clear();
+            start = nullptr;
+            std::fill(std::begin(reverseStarts), std::end(reverseStarts), nullptr);
+            bytes = 0;
+        }
+
+        auto state = std::make_unique<DfaState>();
+        state->kernel = kernel;
+        state->seeds = seeds;
+        state->isDead = kernel.empty() && !seeds;
+        state->isStart = seeds && kernel.size() == 1 && kernel.front() == nfa->start;
+
+        std::fill(onStack.begin(), onStack.end(), false);
+        stack.assign(kernel.begin(), kernel.end());
+        while (!stack.empty())
+        {
+            int id = stack.back();
+            stack.pop_back();
+            if (id < 0 || onStack[id])
+                continue;
+            onStack[id] = true;
+            const NfaState &s = nfa->states[id];
+            if (s.type == NfaState::Type::Match)
+                state->mayAccept = true;
+            else if (s.type != NfaState::Type::Byte)
+            {
+                stack.push_back(s.out);
+                if (s.type == NfaState::Type::Split)
+                    stack.push_back(s.out1);
+            }
+        }
+
+        // The kernel is kept twice, in the state and as its key.
+        bytes += sizeof(DfaState) + (2 * kernel.size() + 1) * sizeof(int);
+        DfaState *p = state.get();
+        cache[std::move(key)] = p;
+        states.push_back(std::move(state));
+        return p;
+    }
+
+    DfaState *compute(DfaState *from, unsigned char b)
+    {
+        std::vector<int> kernel;
+        bool matched = false;
+        if (mode == Mode::Reverse)
+        {
+            std::vector<int> stepped;
+            for (int id : from->kernel)
+            {
+                const NfaState &s = nfa->states[id];
+                if (s.type == NfaState::Type::Byte && s.bytes.test(b))
+                    stepped.push_back(s.out);
+            }
+            closure(stepped, b, kernel);
+        }
+        else
+        {
+            std::vector<int> closed;
+            closure(from->kernel, b, closed);
+            for (int id : closed)
+            {
+                const NfaState &s = nfa->states[id];
+                if (s.type == NfaState::Type::Match)
+                {
+                    from->accepts.set(b);
+                    matched = true;
+                    if (mode == Mode::Leftmost)
+                        break;
+                }
+                else if (s.bytes.test(b))
+                    kernel.push_back(s.out);
+            }
+        }
+
+        DfaState *to = intern(std::move(kernel), from->seeds && !matched);
+        from->next[b] = to;
+        return to;
+    }
+
+public:
+    Dfa(const Nfa &nfa, Mode mode) : nfa(&nfa), mode(mode), onStack(nfa.states.size())
+    {
+    }
+
+    // For Reverse, lookahead is the byte after the end read from.
+    DfaState *startState(unsigned char lookahead = recordSeparator)
+    {
+        if (mode == Mode::Reverse)
+        {
+            DfaState *&s = reverseStarts[lookahead];
+            if (s == nullptr)
+            {
+                std::vector<int> closed;
+                closure({nfa->start}, lookahead, closed);
+                s = intern(std::move(closed), false);
+            }
+            return s;
+        }
+        if (start == nullptr)
+            start = mode == Mode::Leftmost ? intern({}, true) : intern({nfa->start}, false);
+        return start;
+    }
+
+    DfaState *next(DfaState *from, unsigned char b)
+    {
+        DfaState *to = from->next[b];
+        if (to == nullptr)
+            to = compute(from, b);
+        return to;
+    }
+
+    void releaseRetired()
+    {
+        retired.clear();
+    }
+
+    // Roughly what the states built so far take up.
+    size_t memory() const
+    {
+        return bytes;
+    }
+};
+
+// Per-thread search state over a shared, read-only Nfa and its reversal:
+// the lazily built DFAs are caches and are only ever touched by their
+// owner.
+class Automaton
+{
+private:
+    Dfa forward;
+    Dfa anchored;
+    Dfa backward;
+    const Prefilter *prefilter;
+
+    static unsigned char lookahead(std::string_view text, size_t p)
+    {
+        return p < text.size() ? static_cast<unsigned char>(text[p]) : recordSeparator;
+    }
+
+    // Where the leftmost match ending at end, and starting no earlier than
+    // from, starts, read back from end.
+    size_t startOf(std::string_view text, size_t from, size_t end)
+    {
+        size_t first = std::string::npos;
+        DfaState *s = backward.startState(lookahead(text, end));
+        for (size_t p = end;; p--)
+        {
+            if (s->mayAccept)
+                first = p;
+            if (p == from || s->isDead)
+                break;
+            s = backward.next(s, static_cast<unsigned char>(text[p - 1]));
+        }
+        return first;
+    }
+
+public:
+    Automaton(const Nfa &nfa, const Nfa &reversed, const Prefilter *prefilter = nullptr)
+        : forward(nfa, Dfa::Mode::Leftmost), anchored(nfa, Dfa::Mode::Anchored),
+          backward(reversed, Dfa::Mode::Reverse), prefilter(prefilter)
+    {
+    }
+
+    // End of the longest match starting exactly at start, or npos.
+    size_t longestAt(std::string_view text, size_t start)
+    {
+        size_t last = std::string::npos;
+        DfaState *s = anchored.startState();
+        for (size_t p = start;; p++)
+        {
+            unsigned char b = lookahead(text, p);
+            DfaState *to = anchored.next(s, b);
+            if (s->mayAccept && s->accepts.test(b))
+                last = p;
+            if (p >= text.size() || to->isDead)
+                break;
+            s = to;
+        }
+        return last;
+    }
+
+    size_t memory() const
+    {
+        return forward.memory() + anchored.memory() + backward.memory();
+    }
+
+    size_t matchAt(std::string_view text, size_t start)
+    {
+        size_t end = longestAt(text, start);
+        anchored.releaseRetired();
+        return end;
+    }
+
+    // Leftmost-longest match at or after from, in time linear in the text
+    // read. A match from any start has one end, so the forward scan reads
+    // on until the threads started before the last match seen are gone:
+    // that match is the leftmost. The backward scan from its end finds
+    // where it starts.
+    bool find(std::string_view text, size_t from, size_t &start, size_t &end)
+    {
+        DfaState *s = forward.startState();
+        bool found = false;
+        for (size_t p = from;; p++)
+        {
+            if (s->isStart && prefilter != nullptr)
+            {
+                // Nothing is in flight, so the next match can only start
+                // where the prefilter's literal does.
+                p = prefilter->find(text, p);
+                if (p == std::string::npos)
+                    break;
+            }
+            unsigned char b = lookahead(text, p);
+            DfaState *to = forward.next(s, b);
+            if (s->mayAccept && s->accepts.test(b))
+            {
+                end = p;
+                found = true;
+            }
+            if (p >= text.size() || to->isDead)
+                break;
+            s = to;
+        }
+
+        if (found)
+        {
+            start = startOf(text, from, end);
+            found = start != std::string::npos;
+        }
+        forward.releaseRetired();
+        backward.releaseRetired();
+        return found;
+    }
+};
@@ -0,0 +1,591 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "tokens.hpp"
+#include "giggaTree.hpp"
+#include "pattern.hpp"
+#include "staticPattern.hpp"
+
+// Benchmarks the tokenizer, the parser, compilation and matching of one
+// pattern per node type over generated corpora, and prints one row per case
+// as CSV or JSON. Matching runs on both runtime engines, on the native code
+// the tree walker's patterns are compiled to, and on the same pattern
+// compiled in through StaticPattern. Corpora come from a seeded
+// generator, so two builds given the same options measure the same bytes.
+// Exits with failure if matching allocates once warmed up.
+
+std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size_t a = static_cast<size_t>(align);
+    if (void *p = std::aligned_alloc(a, (size + a - 1) / a * a))
+        return p;
+    throw std::bad_alloc();
+}
+
+// Kept out of line: inlined, GCC takes the free() of memory operator new
+// returned for a mismatched pair.
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+// Cycles and branch misses of this thread in user space, read as one group.
+// Unavailable in most containers and VMs; rows then leave both empty.
+class Counters
+{
+private:
+    int cycles = -1;
+    int misses = -1;
+
+    static int open(uint64_t config, int group)
+    {
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = group == -1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+    }
+
+public:
+    Counters()
+    {
+        cycles = open(PERF_COUNT_HW_CPU_CYCLES, -1);
+        if (cycles >= 0)
+            misses = open(PERF_COUNT_HW_BRANCH_MISSES, cycles);
+    }
+
+    Counters(const Counters &) = delete;
+    Counters &operator=(const Counters &) = delete;
+
+    ~Counters()
+    {
+        if (misses >= 0)
+            close(misses);
+        if (cycles >= 0)
+            close(cycles);
+    }
+
+    bool available() const
+    {
+        return misses >= 0;
+    }
+
+    void start()
+    {
+        if (!available())
+            return;
+        ioctl(cycles, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(cycles, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    void stop(uint64_t &cycleCount, uint64_t &missCount)
+    {
+        if (!available())
+            return;
+        ioctl(cycles, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        struct
+        {
+            uint64_t count;
+            uint64_t values[2];
+        } group{};
+        if (read(cycles, &group, sizeof(group)) == static_cast<ssize_t>(sizeof(group)))
+        {
+            cycleCount = group.values[0];
+            missCount = group.values[1];
+        }
+    }
+};
+
+using StaticFind = bool (*)(std::string_view, size_t, size_t &, size_t &);
+
+struct Case
+{
+    std::string node;
+    std::string pattern;
+    StaticFind staticFind;
+};
+
+template <const char *Source>
+Case makeCase(const char *node)
+{
+    return {node, Source, StaticPattern<Source>::find};
+}
+
+constexpr char stringPattern[] = "timeout";
+constexpr char orPattern[] = "error+warning";
+constexpr char manyPattern[] = "lo*g";
+constexpr char manyWildcardPattern[] = "info.*";
+constexpr char counterPattern[] = "o{2}";
+constexpr char counterWildcardPattern[] = "x.{3}";
+constexpr char wildcardPattern[] = "t.me";
+constexpr char groupPattern[] = "(time)out";
+constexpr char ignorePattern[] = "error\\I";
+constexpr char groupSelectorPattern[] = "(time)out\\O{1}";
+constexpr char manyRunPattern[] = "a*";
+constexpr char counterRunPattern[] = "a{8}";
+
+// One pattern per node type; the ones over a wildcard take a different path
+// in both engines, so they get their own rows.
+const std::vector<Case> cases = {
+    makeCase<stringPattern>("StringNode"),
+    makeCase<orPattern>("OrNode"),
+    makeCase<manyPattern>("ManyNode"),
+    makeCase<manyWildcardPattern>("ManyNode"),
+    makeCase<counterPattern>("CounterNode"),
+    makeCase<counterWildcardPattern>("CounterNode"),
+    makeCase<wildcardPattern>("WildcardNode"),
+    makeCase<groupPattern>("GroupNode"),
+    makeCase<ignorePattern>("IgnoreNode"),
+    makeCase<groupSelectorPattern>("GroupSelectorNode"),
+    makeCase<manyRunPattern>("ManyNode"),
+    makeCase<counterRunPattern>("CounterNode"),
+};
+
+struct Corpus
+{
+    std::string name;
+    std::string text;
+};
+
+// Log-like lines over a vocabulary every case pattern finds something in.
+std::string words(size_t size, std::mt19937_64 &rng, char separator)
+{
+    static const char *vocabulary[] = {"the", "info", "debug", "error", "ERROR", "warning", "Warning", "timeout",
+                                       "time", "tine", "loop", "loooog", "log", "Waterloo", "x123", "xyzw",
+                                       "request", "user", "id", "aaaaaaaaaa", "ok"};
+    std::string text;
+    text.reserve(size);
+    std::uniform_int_distribution<size_t> word(0, std::size(vocabulary) - 1);
+    std::uniform_int_distribution<int> lineLength(4, 20);
+    while (text.size() < size)
+    {
+        int n = lineLength(rng);
+        for (int i = 0; i < n; i++)
+        {
+            text += vocabulary[word(rng)];
+            text += ' ';
+        }
+        text.back() = separator;
+    }
+    text.resize(size);
+    return text;
+}
+
+// Runs of 'a' up to 4 KiB long: the worst case for a* and a{8}, which must
+// consume every run byte by byte.
+std::string runs(size_t size, std::mt19937_64 &rng)
+{
+    std::string text;
+    text.reserve(size);
+    std::uniform_int_distribution<size_t> runLength(1, 4096);
+    while (text.size() < size)
+    {
+        text.append(runLength(rng), 'a');
+        text += rng() % 8 == 0 ? '\n' : 'b';
+    }
+    text.resize(size);
+    return text;
+}
+
+// Prefixes of the case literals that never complete, so every prefilter
+// candidate fails verification and the matchers start over constantly.
+std::string nearMisses(size_t size)
+{
+    static const std::string line = "timeou erro warnin tim(e lo looo x12 errorr\n";
+    std::string text;
+    text.reserve(size + line.size());
+    while (text.size() < size)
+        text += line;
+    text.resize(size);
+    return text;
+}
+
+struct Result
+{
+    std::string benchmark;
+    std::string node;
+    std::string pattern;
+    std::string corpus;
+    std::string engine;
+    uint64_t bytes = 0;
+    uint64_t passes = 0;
+    double seconds = 0;
+    uint64_t matches = 0;
+    uint64_t allocations = 0;
+    bool hasCounters = false;
+    uint64_t cycles = 0;
+    uint64_t branchMisses = 0;
+};
+
+// Repeats pass() until minTime has elapsed, at least once. pass() returns
+// the number of matches or tokens it produced. All counts in result
+// are per pass.
+template <typename Pass>
+void measure(Result &result, uint64_t bytes, double minTime, Pass pass)
+{
+    Counters counters;
+    uint64_t produced = 0;
+    uint64_t cycles = 0, misses = 0;
+    uint64_t allocated = allocations.load();
+    auto begin = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    uint64_t passes = 0;
+    counters.start();
+    do
+    {
+        produced += pass();
+        passes++;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    } while (elapsed < minTime);
+    counters.stop(cycles, misses);
+
+    result.bytes = bytes;
+    result.passes = passes;
+    result.seconds = elapsed / passes;
+    result.matches = produced / passes;
+    result.allocations = (allocations.load() - allocated) / passes;
+    result.hasCounters = counters.available();
+    result.cycles = cycles / passes;
+    result.branchMisses = misses / passes;
+}
+
+void printCsvHeader()
+{
+    std::cout << "benchmark,node,pattern,corpus,engine,bytes,passes,seconds,bytes_per_sec,matches,matches_per_sec,"
+                 "allocations,allocs_per_match,cycles_per_byte,branch_misses\n";
+}
+
+void printCsv(const Result &r)
+{
+    std::string pattern;
+    for (char c : r.pattern)
+        pattern += c == '"' ? std::string("\"\"") : std::string(1, c);
+    std::cout << r.benchmark << "," << r.node << ",\"" << pattern << "\"," << r.corpus << "," << r.engine << ","
+              << r.bytes << "," << r.passes << "," << r.seconds << "," << r.bytes / r.seconds << "," << r.matches
+              << "," << r.matches / r.seconds << "," << r.allocations << ",";
+    if (r.matches > 0)
+        std::cout << static_cast<double>(r.allocations) / r.matches;
+    std::cout << ",";
+    if (r.hasCounters && r.bytes > 0)
+        std::cout << static_cast<double>(r.cycles) / r.bytes;
+    std::cout << ",";
+    if (r.hasCounters)
+        std::cout << r.branchMisses;
+    std::cout << "\n";
+}
+
+void printJson(const Result &r, bool first)
+{
+    std::string pattern;
+    for (char c : r.pattern)
+    {
+        if (c == '"' || c == '\\')
+            pattern += '\\';
+        pattern += c;
+    }
+    std::cout << (first ? "[\n" : ",\n") << "  {\"benchmark\": \"" << r.benchmark << "\", \"node\": \"" << r.node
+              << "\", \"pattern\": \"" << pattern << "\", \"corpus\": \"" << r.corpus << "\", \"engine\": \""
+              << r.engine << "\", \"bytes\": " << r.bytes << ", \"passes\": " << r.passes
+              << ", \"seconds\": " << r.seconds << ", \"bytes_per_sec\": " << r.bytes / r.seconds
+              << ", \"matches\": " << r.matches << ", \"matches_per_sec\": " << r.matches / r.seconds
+              << ", \"allocations\": " << r.allocations << ", \"allocs_per_match\": ";
+    if (r.matches > 0)
+        std::cout << static_cast<double>(r.allocations) / r.matches;
+    else
+        std::cout << "null";
+    std::cout << ", \"cycles_per_byte\": ";
+    if (r.hasCounters && r.bytes > 0)
+        std::cout << static_cast<double>(r.cycles) / r.bytes;
+    else
+        std::cout << "null";
+    std::cout << ", \"branch_misses\": ";
+    if (r.hasCounters)
+        std::cout << r.branchMisses;
+    else
+        std::cout << "null";
+    std::cout << "}";
+}
+
+// 64K, 1M, 1G and plain byte counts.
+bool parseSize(const std::string &s, uint64_t &size)
+{
+    char *end;
+    size = std::strtoull(s.c_str(), &end, 10);
+    std::string suffix = end;
+    if (suffix == "K")
+        size <<= 10;
+    else if (suffix == "M")
+        size <<= 20;
+    else if (suffix == "G")
+        size <<= 30;
+    else if (!suffix.empty())
+        return false;
+    return end != s.c_str() && size > 0;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint64_t> sizes = {64 << 10, 1 << 20, 16 << 20};
+    // The pathological corpora stop at this size, since some cases on them
+    // are quadratic in the record length.
+    uint64_t pathologicalSize = 1 << 20;
+    std::vector<std::string> engines = {"dfa", "tree", "jit", "static"};
+    double minTime = 0.1;
+    const size_t batchSize = 1024;
+    uint64_t seed = 1;
+    bool json = false;
+    std::string filter;
+
+    for (int arg = 1; arg < argc; arg++)
+    {
+        std::string option = argv[arg];
+        if (option.rfind("--sizes=", 0) == 0)
+        {
+            sizes.clear();
+            std::string list = option.substr(8);
+            for (size_t at = 0; at <= list.size();)
+            {
+                size_t comma = std::min(list.find(',', at), list.size());
+                uint64_t size;
+                if (!parseSize(list.substr(at, comma - at), size))
+                {
+                    std::cerr << "Bad size in " << option << "\n";
+                    return EXIT_FAILURE;
+                }
+                sizes.push_back(size);
+                at = comma + 1;
+            }
+        }
+        else if (option.rfind("--pathological=", 0) == 0)
+        {
+            if (!parseSize(option.substr(15), pathologicalSize))
+            {
+                std::cerr << "Bad size in " << option << "\n";
+                return EXIT_FAILURE;
+            }
+        }
+        else if (option.rfind("--engine=", 0) == 0)
+        {
+            std::string name = option.substr(9);
+            if (name != "tree" && name != "jit" && name != "dfa" && name != "static")
+            {
+                std::cerr << "Unknown engine " << name << "\n";
+                return EXIT_FAILURE;
+            }
+            engines = {name};
+        }
+        else if (option.rfind("--min-time=", 0) == 0)
+        {
+            minTime = std::atof(option.c_str() + 11);
+        }
+        else if (option.rfind("--seed=", 0) == 0)
+        {
+            seed = std::strtoull(option.c_str() + 7, nullptr, 10);
+        }
+        else if (option == "--json")
+        {
+            json = true;
+        }
+        else if (option.rfind("--filter=", 0) == 0)
+        {
+            filter = option.substr(9);
+        }
+        else
+        {
+            std::cerr << "Unknown option " << option << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    bool first = true;
+    auto report = [&](const Result &r)
+    {
+        if (json)
+            printJson(r, first);
+        else
+        {
+            if (first)
+                printCsvHeader();
+            printCsv(r);
+        }
+        first = false;
+        std::cout.flush();
+    };
+    // Matching has to be allocation-free once its context has warmed up,
+    // so the match rows take one untimed pass first and then must not
+    // allocate at all.
+    bool allocating = false;
+    auto measureSteady = [&](Result &r, uint64_t bytes, double minTime, auto pass)
+    {
+        pass();
+        uint64_t before = allocations.load();
+        measure(r, bytes, minTime, pass);
+        if (allocations.load() != before)
+        {
+            std::cerr << r.benchmark << "/" << r.node << "/" << r.pattern << "/" << r.corpus << "/" << r.engine
+                      << " allocated " << allocations.load() - before << " times after warming up\n";
+            allocating = true;
+        }
+    };
+    auto selected = [&](const Result &r)
+    {
+        return filter.empty() || (r.benchmark + "/" + r.node + "/" + r.pattern + "/" + r.corpus + "/" + r.engine)
+                                         .find(filter) != std::string::npos;
+    };
+
+    for (auto &c : cases)
+    {
+        Result r;
+        r.node = c.node;
+        r.pattern = c.pattern;
+        r.corpus = "-";
+        r.engine = "-";
+
+        r.benchmark = "tokenize";
+        if (selected(r))
+        {
+            measure(r, c.pattern.size(), minTime, [&]
+                    { return Tokenizer(c.pattern).takeTokens().size(); });
+            report(r);
+        }
+
+        // The parser consumes its tokens, so each pass hands it a copy of
+        // the vector, which costs one allocation.
+        r.benchmark = "parse";
+        if (selected(r))
+        {
+            auto tokens = Tokenizer(c.pattern).takeTokens();
+            measure(r, c.pattern.size(), minTime, [&]
+                    { return Parser(tokens).parse(); });
+            report(r);
+        }
+
+        r.benchmark = "compile";
+        if (selected(r))
+        {
+            measure(r, c.pattern.size(), minTime, [&]
+                    { return Pattern::compile(c.pattern) != nullptr; });
+            report(r);
+        }
+    }
+
+    for (uint64_t size : sizes)
+    {
+        std::mt19937_64 rng(seed);
+        std::vector<Corpus> corpora;
+        std::string suffix = "/" + std::to_string(size);
+        corpora.push_back({"words" + suffix, words(size, rng, '\n')});
+        if (size <= pathologicalSize)
+        {
+            corpora.push_back({"runs" + suffix, runs(size, rng)});
+            corpora.push_back({"nearmiss" + suffix, nearMisses(size)});
+            corpora.push_back({"oneline" + suffix, words(size, rng, ' ')});
+        }
+
+        for (auto &corpus : corpora)
+        {
+            for (auto &c : cases)
+            {
+                for (auto &engine : engines)
+                {
+                    Result r;
+                    r.benchmark = "match";
+                    r.node = c.node;
+                    r.pattern = c.pattern;
+                    r.corpus = corpus.name;
+                    r.engine = engine;
+                    if (!selected(r))
+                        continue;
+
+                    std::string_view text = corpus.text;
+                    if (engine == "static")
+                    {
+                        measureSteady(r, text.size(), minTime, [&]
+                                      {
+                                          uint64_t matches = 0;
+                                          size_t start, end;
+                                          for (size_t from = 0; c.staticFind(text, from, start, end); from = std::max(end, start + 1))
+                                              matches++;
+                                          return matches; });
+                        report(r);
+                        continue;
+                    }
+
+                    auto pattern = Pattern::compile(c.pattern, engine == "dfa" ? Pattern::Engine::Automaton
+                                                                               : Pattern::Engine::Tree);
+                    // The tree rows time the walker, the jit rows the code
+                    // it is compiled to on the untimed pass.
+                    pattern->jitAfter = engine == "jit" ? 0 : Pattern::noJit;
+                    MatchContext ctx(*pattern);
+                    measureSteady(r, text.size(), minTime, [&]
+                                  {
+                                      uint64_t matches = 0;
+                                      MatchIterator it(*pattern, ctx, text);
+                                      while (it.next())
+                                          matches++;
+                                      return matches; });
+                    report(r);
+
+                    r.benchmark = "batch";
+                    if (!selected(r))
+                        continue;
+                    std::vector<uint64_t> starts(batchSize), ends(batchSize);
+                    MatchBatch batch{starts.data(), ends.data(), batchSize};
+                    measureSteady(r, text.size(), minTime, [&]
+                                  {
+                                      uint64_t matches = 0;
+                                      size_t from = 0;
+                                      while (size_t n = pattern->findAll(ctx, text, from, batch))
+                                          matches += n;
+                                      return matches; });
+                    report(r);
+                }
+            }
+        }
+    }
+
+    if (json)
+        std::cout << (first ? "[]\n" : "\n]\n");
+    return allocating ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// ASCII case folding, the same as tolower() in the C locale the matcher runs
+// in. Literals are folded once when the pattern is built; text is folded on
+// the fly, 16 or 32 bytes per step.
+
+unsigned char foldByte(unsigned char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+bool isFoldable(unsigned char c)
+{
+    return foldByte(c) >= 'a' && foldByte(c) <= 'z';
+}
+
+std::string foldCase(std::string_view s)
+{
+    std::string folded(s);
+    for (auto &c : folded)
+        c = foldByte(c);
+    return folded;
+}
+
+bool equalsFoldedScalar(const char *text, const char *folded, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (foldByte(text[i]) != static_cast<unsigned char>(folded[i]))
+            return false;
+    }
+    return true;
+}
+
+#if defined(__x86_64__)
+// 'A'..'Z' shifted to the bottom of the signed range is one compare.
+__m128i foldSse2(__m128i x)
+{
+    __m128i shifted = _mm_add_epi8(x, _mm_set1_epi8(static_cast<char>(128 - 'A')));
+    __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(-128 + 26)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+bool equalsFoldedSse2(const char *text, const char *folded, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = foldSse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i)));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(folded + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+            return false;
+    }
+    return equalsFoldedScalar(text + i, folded + i, n - i);
+}
+
+__attribute__((target("avx2"))) __m256i foldAvx2(__m256i x)
+{
+    __m256i shifted = _mm256_add_epi8(x, _mm256_set1_epi8(static_cast<char>(128 - 'A')));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(-128 + 26)), shifted);
+    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2"))) bool equalsFoldedAvx2(const char *text, const char *folded, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i x = foldAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i)));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(folded + i));
+        if (static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y))) != 0xFFFFFFFFu)
+            return false;
+    }
+    return equalsFoldedSse2(text + i, folded + i, n - i);
+}
+#endif
+
+// Whether text[0, n) equals the already folded folded[0, n), ignoring case.
+bool equalsFolded(const char *text, const char *folded, size_t n)
+{
+#if defined(__x86_64__)
+    static const auto impl = __builtin_cpu_supports("avx2") ? equalsFoldedAvx2 : equalsFoldedSse2;
+    return impl(text, folded, n);
+#else
+    return equalsFoldedScalar(text, folded, n);
+#endif
+}
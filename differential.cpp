@@ -0,0 +1,162 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdlib>
+#include <cstdint>
+#include "pattern.hpp"
+
+// Matches random patterns over random records with both engines, and with
+// the walker's native code, and fails on the first pattern they disagree
+// on. The walker is the reference: the others must report exactly the
+// matches it does. Patterns are built from a small alphabet, heavy on +,
+// so operands often share a prefix. A fixed set of * and + followed by more
+// items goes first, the shapes whose failure memo the native code keeps.
+
+const char *const trailing[] = {
+    "a*b", "a*cb*c", "a*ab", "b+ab", "b*ab+bab", "a+.b", ".*a", "a*.{2}c", "(a*b)c", "a*(b+c)a",
+    "A*ab\\I", "b{2}a*ba+bc", "a*b*c", "(ab+a)b*a",
+};
+
+std::string randomOperand(std::mt19937_64 &rng)
+{
+    static const char letters[] = "abAB.";
+    std::string operand;
+    size_t length = 1 + rng() % 3;
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = letters[rng() % 5];
+        if (c == '.')
+            return operand.empty() ? "." : operand;
+        operand += c;
+    }
+    return operand;
+}
+
+std::string randomPattern(std::mt19937_64 &rng)
+{
+    std::string pattern;
+    size_t items = 1 + rng() % 5;
+    for (size_t i = 0; i < items; i++)
+    {
+        bool group = rng() % 4 == 0;
+        if (group)
+            pattern += '(';
+        pattern += randomOperand(rng);
+        switch (rng() % 6)
+        {
+        case 0:
+        case 1:
+        case 2:
+            pattern += '+' + randomOperand(rng);
+            break;
+        case 3:
+            pattern += '*';
+            break;
+        case 4:
+            pattern += "{" + std::to_string(1 + rng() % 3) + "}";
+            break;
+        default:
+            break;
+        }
+        if (group)
+            pattern += ')';
+    }
+    if (rng() % 4 == 0)
+        pattern += "\\I";
+    return pattern;
+}
+
+std::string randomRecords(std::mt19937_64 &rng)
+{
+    static const char letters[] = "abcAB";
+    std::string text;
+    size_t records = 1 + rng() % 4;
+    for (size_t r = 0; r < records; r++)
+    {
+        size_t length = rng() % 16;
+        for (size_t i = 0; i < length; i++)
+            text += letters[rng() % 5];
+        text += '\n';
+    }
+    return text;
+}
+
+std::vector<Span> matches(const Pattern &pattern, std::string_view text)
+{
+    MatchContext ctx(pattern);
+    std::vector<Span> spans;
+    MatchIterator it(pattern, ctx, text);
+    while (it.next())
+        spans.push_back(it.span());
+    return spans;
+}
+
+std::string describe(const std::vector<Span> &spans)
+{
+    std::string out;
+    for (auto &s : spans)
+        out += " " + std::to_string(s.start) + "-" + std::to_string(s.end);
+    return out.empty() ? " none" : out;
+}
+
+// Whether the engines agree on source over texts random records; false,
+// after saying where, if not. Malformed patterns agree trivially.
+bool agree(const std::string &source, std::mt19937_64 &rng, int texts)
+{
+    auto tree = Pattern::compile(source, Pattern::Engine::Tree);
+    if (!tree)
+        return true;
+    tree->jitAfter = Pattern::noJit;
+    auto automaton = Pattern::compile(source, Pattern::Engine::Automaton);
+    auto jit = Pattern::compile(source, Pattern::Engine::Tree);
+    jit->jitAfter = 0;
+    for (int t = 0; t < texts; t++)
+    {
+        auto text = randomRecords(rng);
+        auto expected = matches(*tree, text);
+        for (auto [engine, pattern] : {std::pair{"dfa", automaton.get()}, std::pair{"jit", jit.get()}})
+        {
+            auto actual = matches(*pattern, text);
+            if (expected.size() != actual.size() ||
+                !std::equal(expected.begin(), expected.end(), actual.begin(), [](const Span &a, const Span &b)
+                            { return a.start == b.start && a.end == b.end; }))
+            {
+                std::cerr << "Pattern " << source << " on \"" << text << "\": tree" << describe(expected) << ", "
+                          << engine << describe(actual) << "\n";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t seed = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1;
+    size_t patterns = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 5000;
+    std::mt19937_64 rng(seed);
+
+    for (const char *source : trailing)
+    {
+        if (!Pattern::compile(source, Pattern::Engine::Tree))
+        {
+            std::cerr << "Pattern " << source << " doesn't parse\n";
+            return EXIT_FAILURE;
+        }
+        if (!agree(source, rng, 256))
+            return EXIT_FAILURE;
+    }
+    size_t compared = 0;
+    for (size_t i = 0; i < patterns; i++)
+    {
+        auto source = randomPattern(rng);
+        if (!Pattern::compile(source, Pattern::Engine::Tree))
+            continue;
+        if (!agree(source, rng, 8))
+            return EXIT_FAILURE;
+        compared++;
+    }
+    std::cout << compared << " patterns agree, and " << std::size(trailing) << " fixed ones\n";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "mappedScan.hpp"
+
+struct SearchFile
+{
+    std::string path;
+    uint64_t size;
+    // Only large files are mapped, while their pieces are searched.
+    std::unique_ptr<MappedFile> mapped;
+};
+
+// The part of a file one task searches: whole records from begin to end.
+struct SearchTask
+{
+    size_t file;
+    size_t begin;
+    size_t end;
+    // Whether no later task covers more of the same file.
+    bool last;
+};
+
+template <typename OnError>
+void walkDirectory(const std::string &directory, std::vector<SearchFile> &files, OnError &onError)
+{
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr)
+    {
+        onError(directory);
+        return;
+    }
+    std::vector<std::string> names;
+    while (dirent *entry = readdir(dir))
+    {
+        std::string_view name = entry->d_name;
+        if (name != "." && name != "..")
+            names.emplace_back(name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    std::string prefix = directory.back() == '/' ? directory : directory + "/";
+    for (auto &name : names)
+    {
+        std::string path = prefix + name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0)
+            onError(path);
+        else if (S_ISDIR(st.st_mode))
+            walkDirectory(path, files, onError);
+        else if (S_ISREG(st.st_mode))
+            files.push_back({path, static_cast<uint64_t>(st.st_size), nullptr});
+    }
+}
+
+// Regular files under paths, with directories walked recursively. Entries
+// are taken in name order so the list is the same on every run. As in
+// grep -r, symbolic links are followed when named in paths but not when
+// found in a directory. Paths that can't be read are passed to onError.
+template <typename OnError>
+std::vector<SearchFile> listFiles(const std::vector<std::string> &paths, OnError onError)
+{
+    std::vector<SearchFile> files;
+    for (auto &path : paths)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            onError(path);
+        else if (S_ISDIR(st.st_mode))
+            walkDirectory(path, files, onError);
+        else
+            files.push_back({path, static_cast<uint64_t>(st.st_size), nullptr});
+    }
+    return files;
+}
+
+// Splits the search into tasks in file order. A file is one task unless it
+// is over twice pieceSize; then it is mapped and split into pieces of about
+// pieceSize at record boundaries, so that one huge file keeps every worker
+// busy. The plan doesn't depend on the number of workers, nor does the
+// output. Files that can't be mapped are passed to onError.
+template <typename OnError>
+std::vector<SearchTask> planTasks(std::vector<SearchFile> &files, size_t pieceSize, OnError onError)
+{
+    std::vector<SearchTask> tasks;
+    for (size_t file = 0; file < files.size(); file++)
+    {
+        auto &f = files[file];
+        if (f.size <= 2 * pieceSize)
+        {
+            tasks.push_back({file, 0, static_cast<size_t>(f.size), true});
+            continue;
+        }
+        f.mapped = std::make_unique<MappedFile>(f.path);
+        if (!f.mapped->isOpen())
+        {
+            f.mapped.reset();
+            onError(f.path);
+            continue;
+        }
+        auto data = f.mapped->view();
+        auto bounds = splitRecords(data, static_cast<unsigned>(data.size() / pieceSize));
+        for (size_t i = 0; i + 1 < bounds.size(); i++)
+            tasks.push_back({file, bounds[i], bounds[i + 1], i + 2 == bounds.size()});
+    }
+    return tasks;
+}
+
+// Reads all of path into buffer, which keeps its capacity from one file to
+// the next. expected is the size the file had when it was listed; a file
+// that has grown since is still read to the end.
+bool readFile(const std::string &path, uint64_t expected, std::vector<char> &buffer, std::string_view &text)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (buffer.size() < expected + 1)
+        buffer.resize(expected + 1);
+    size_t filled = 0;
+    while (true)
+    {
+        if (filled == buffer.size())
+            buffer.resize(buffer.size() * 2);
+        ssize_t n = ::read(fd, buffer.data() + filled, buffer.size() - filled);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return false;
+        }
+        if (n == 0)
+            break;
+        filled += n;
+    }
+    close(fd);
+    text = std::string_view(buffer.data(), filled);
+    return true;
+}
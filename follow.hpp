@@ -0,0 +1,220 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "asyncReader.hpp"
+
+// Follows files by name as they grow, as tail -F does. Each file is read
+// from where the last read stopped, so the work per change is the bytes
+// appended, whatever the file's size. The partial record at the end is
+// carried until its '\n' is written. A file cut shorter than what was read
+// is read again from the start, and one replaced under its name, as a
+// rotated log is, is read to its end before the new one is followed from
+// its beginning. Changes are picked up through inotify watches on the
+// files' directories, and every second regardless, for file systems that
+// don't report them.
+class FileFollower
+{
+private:
+    struct File
+    {
+        std::string path;
+        std::string name;
+        int watch = -1;
+        int fd = -1;
+        dev_t device = 0;
+        ino_t inode = 0;
+        uint64_t offset = 0;
+        RecordJoiner joiner;
+        bool missing = false;
+    };
+
+    std::vector<File> files;
+    int inotify = -1;
+    std::vector<char> buffer;
+
+    void open(File &f, bool atEnd)
+    {
+        f.fd = ::open(f.path.c_str(), O_RDONLY);
+        struct stat st;
+        if (f.fd < 0 || fstat(f.fd, &st) != 0)
+        {
+            if (!f.missing)
+                std::cerr << "Could not open " << f.path << "; waiting for it to appear\n";
+            f.missing = true;
+            if (f.fd >= 0)
+                close(f.fd);
+            f.fd = -1;
+            return;
+        }
+        f.missing = false;
+        f.device = st.st_dev;
+        f.inode = st.st_ino;
+        f.offset = atEnd ? st.st_size : 0;
+        f.joiner.start(f.offset);
+    }
+
+    // Reads what was appended to f since the last call.
+    template <typename OnRecords>
+    bool readAppended(File &f, OnRecords &onRecords)
+    {
+        struct stat st;
+        if (fstat(f.fd, &st) != 0)
+            return true;
+        if (static_cast<uint64_t>(st.st_size) < f.offset)
+        {
+            std::cerr << f.path << ": file truncated\n";
+            f.offset = 0;
+            f.joiner.start(0);
+        }
+        while (true)
+        {
+            ssize_t n = pread(f.fd, buffer.data(), buffer.size(), f.offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return true;
+            f.offset += n;
+            if (!f.joiner.add(std::string_view(buffer.data(), n), onRecords))
+                return false;
+        }
+    }
+
+    template <typename OnRecords>
+    bool update(size_t index, OnRecords &onRecords)
+    {
+        File &f = files[index];
+        auto onFileRecords = [&](std::string_view records, uint64_t offset)
+        {
+            return onRecords(index, records, offset);
+        };
+
+        if (f.fd >= 0 && !readAppended(f, onFileRecords))
+            return false;
+
+        struct stat st;
+        bool replaced = stat(f.path.c_str(), &st) == 0 && (f.fd < 0 || st.st_dev != f.device || st.st_ino != f.inode);
+        if (!replaced)
+            return true;
+        if (f.fd >= 0)
+        {
+            // Whatever was left of the old file's last record is all of it.
+            f.joiner.finish(onFileRecords);
+            close(f.fd);
+            std::cerr << f.path << " has been replaced; following the new file\n";
+        }
+        open(f, false);
+        return f.fd < 0 || readAppended(f, onFileRecords);
+    }
+
+public:
+    FileFollower(const std::vector<std::string> &paths) : buffer(1 << 20)
+    {
+        inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        for (auto &path : paths)
+        {
+            File f;
+            f.path = path;
+            auto slash = path.rfind('/');
+            std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+            f.name = slash == std::string::npos ? path : path.substr(slash + 1);
+            if (inotify >= 0)
+                f.watch = inotify_add_watch(inotify, directory.c_str(),
+                                            IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+            files.push_back(std::move(f));
+        }
+        for (auto &f : files)
+            open(f, true);
+    }
+
+    FileFollower(const FileFollower &) = delete;
+    FileFollower &operator=(const FileFollower &) = delete;
+
+    ~FileFollower()
+    {
+        for (auto &f : files)
+        {
+            if (f.fd >= 0)
+                close(f.fd);
+        }
+        if (inotify >= 0)
+            close(inotify);
+    }
+
+    const std::string &path(size_t index) const
+    {
+        return files[index].path;
+    }
+
+    // Waits for changes and passes the runs of records appended since to
+    // onRecords(index, records, offset), offsets into the file, until it
+    // returns false. onBatch() is called once every change seen at once has
+    // been read, which is when output should go out.
+    template <typename OnRecords, typename OnBatch>
+    void run(OnRecords onRecords, OnBatch onBatch)
+    {
+        std::vector<char> events(64 * (sizeof(inotify_event) + NAME_MAX + 1));
+        std::vector<bool> changed(files.size());
+        // Every file is looked at a second after the last such look, even
+        // while events for other files in the directories keep coming.
+        const auto recheck = std::chrono::seconds(1);
+        auto lastCheck = std::chrono::steady_clock::now();
+        while (true)
+        {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                lastCheck + recheck - std::chrono::steady_clock::now());
+            int timeout = static_cast<int>(std::max<int64_t>(0, wait.count()));
+            pollfd p = {inotify, POLLIN, 0};
+            int ready = inotify >= 0 ? poll(&p, 1, timeout) : (usleep(timeout * 1000), 0);
+            if (ready < 0 && errno != EINTR)
+                return;
+
+            if (ready > 0)
+            {
+                ssize_t n;
+                while ((n = ::read(inotify, events.data(), events.size())) > 0)
+                {
+                    for (char *at = events.data(); at < events.data() + n;)
+                    {
+                        auto event = reinterpret_cast<inotify_event *>(at);
+                        at += sizeof(inotify_event) + event->len;
+                        for (size_t i = 0; i < files.size(); i++)
+                        {
+                            if (files[i].watch == event->wd && event->len != 0 && files[i].name == event->name)
+                                changed[i] = true;
+                        }
+                    }
+                }
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastCheck >= recheck)
+            {
+                changed.assign(files.size(), true);
+                lastCheck = now;
+            }
+
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                if (changed[i] && !update(i, onRecords))
+                {
+                    onBatch();
+                    return;
+                }
+                changed[i] = false;
+            }
+            onBatch();
+        }
+    }
+};
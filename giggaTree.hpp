@@ -4,660 +4,1131 @@
 #include <memory>
 #include <iostream>
 #include "tokens.hpp"
+#include "automaton.hpp"
+#include "caseFold.hpp"
+#include "runLength.hpp"
 #include <string>
+#include <string_view>
+#include <cstring>
 #include <algorithm>
-#include <map>
-
-int currentChar = 0;
-int startingChar = 0;
-bool parentIsIgnore = false;
-bool visitedWhildcard = false;
-bool hasBuiltGroupSelector = false;
-std::string text;
+#include <chrono>
+#include <cstdint>
 
+// Offsets are 64-bit so a mapped file past 2 GiB is addressed correctly.
 struct GroupIndexe
 {
-    int start;
-    int end;
+    size_t start = std::string::npos;
+    size_t end = std::string::npos;
 };
 
-std::map<int, GroupIndexe> indexes;
+struct Pattern;
+class JitCode;
 
-struct ASTNode
+// Bounds on the work the tree walker may spend searching one record. Zero
+// means unbounded. A step is the evaluation of one item of the pattern.
+struct MatchBudget
 {
-    virtual ~ASTNode() = default;
-    virtual bool evaluate() = 0;
-    std::vector<std::unique_ptr<ASTNode>> children;
-    virtual void print() = 0;
+    uint64_t steps = 0;
+    std::chrono::nanoseconds time{0};
 };
 
-struct OrNode : ASTNode
+#if defined(PATTERN_PROFILE)
+// What the walker did with one node. Time includes the node's children and
+// is wall-clock time, so it is only the walker's own with one thread per
+// core. Rewinds are Or branches tried again from the checkpoint and, on the
+// root, starts retried one byte further on.
+struct NodeProfile
 {
-    void print() override
+    uint64_t calls = 0;
+    uint64_t matches = 0;
+    uint64_t bytes = 0;
+    uint64_t rewinds = 0;
+    uint64_t memoHits = 0;
+    std::chrono::nanoseconds time{0};
+
+    NodeProfile &operator+=(const NodeProfile &other)
     {
-        std::cout << "+";
+        calls += other.calls;
+        matches += other.matches;
+        bytes += other.bytes;
+        rewinds += other.rewinds;
+        memoHits += other.memoHits;
+        time += other.time;
+        return *this;
     }
-    bool evaluate() override
-    {
-        int checkpoint = currentChar;
-        bool lhsSuccsess = children.front()->evaluate();
-        int lhsEnd = currentChar;
-        currentChar = checkpoint;
-        bool rhsSuccess = children.back()->evaluate();
-        int rhsEnd = currentChar;
-        if (!lhsSuccsess && !rhsSuccess)
-        {
-            currentChar = lhsEnd > rhsEnd ? lhsEnd : rhsEnd;
-            return false;
-        }
-        if (lhsSuccsess && rhsSuccess)
-        {
-            currentChar = lhsEnd > rhsEnd ? lhsEnd : rhsEnd;
-            return true;
-        }
-        if (lhsSuccsess)
-        {
+};
+#endif
 
-            currentChar = lhsEnd;
-            return true;
-        }
-        currentChar = rhsEnd;
-        return true;
+struct MatchStats
+{
+    uint64_t searches = 0;
+    uint64_t memoHits = 0;
+    uint64_t budgetHits = 0;
+#if defined(PATTERN_PROFILE)
+    // One per node of the pattern's tree, so only stats of one pattern add up.
+    std::vector<NodeProfile> nodes;
+#endif
+
+    MatchStats &operator+=(const MatchStats &other)
+    {
+        searches += other.searches;
+        memoHits += other.memoHits;
+        budgetHits += other.budgetHits;
+#if defined(PATTERN_PROFILE)
+        nodes.resize(std::max(nodes.size(), other.nodes.size()));
+        for (size_t i = 0; i < other.nodes.size(); i++)
+            nodes[i] += other.nodes[i];
+#endif
+        return *this;
     }
 };
 
-struct ManyNode : ASTNode
+// Set of (item, position) keys at which the rest of a sequence of items is
+// known not to match. Open addressing over slots stamped with the search
+// that wrote them, so starting a new search doesn't touch the table.
+class FailureMemo
 {
-    void print() override
+private:
+    struct Slot
     {
-        std::cout << "*";
+        uint64_t key;
+        uint32_t generation;
+    };
+
+    std::vector<Slot> slots;
+    size_t used = 0;
+    uint32_t generation = 1;
+
+    size_t slot(uint64_t key) const
+    {
+        return (key * 0x9E3779B97F4A7C15ull >> 32) & (slots.size() - 1);
     }
-    bool evaluate() override
+
+    void grow()
     {
-        for (auto &c : children)
+        auto old = std::move(slots);
+        slots.assign(std::max<size_t>(64, old.size() * 2), {0, 0});
+        used = 0;
+        for (auto &s : old)
         {
-            if (!c->evaluate())
-            {
-                return false;
-            }
+            if (s.generation == generation)
+                insert(s.key);
         }
-        if (visitedWhildcard)
+    }
+
+public:
+    void clear()
+    {
+        used = 0;
+        if (++generation == 0)
         {
-            currentChar = text.size();
-            visitedWhildcard = false;
-            return true;
+            for (auto &s : slots)
+                s.generation = 0;
+            generation = 1;
         }
-        char c = text[currentChar - 1];
-        if (currentChar >= text.size() || text[currentChar] != c)
-        {
+    }
+
+    size_t memory() const
+    {
+        return slots.capacity() * sizeof(Slot);
+    }
+
+    bool contains(uint64_t key) const
+    {
+        if (used == 0)
             return false;
+        for (size_t i = slot(key);; i = (i + 1) & (slots.size() - 1))
+        {
+            if (slots[i].generation != generation)
+                return false;
+            if (slots[i].key == key)
+                return true;
         }
-        while (currentChar != text.size())
+    }
+
+    void insert(uint64_t key)
+    {
+        if ((used + 1) * 2 > slots.size())
+            grow();
+        for (size_t i = slot(key);; i = (i + 1) & (slots.size() - 1))
         {
-            if (text[currentChar] != c)
+            if (slots[i].generation != generation)
             {
-                break;
+                slots[i] = {key, generation};
+                used++;
+                return;
             }
-            currentChar++;
+            if (slots[i].key == key)
+                return;
         }
-
-        // std::cout << "\"" << text[currentChar] << "\"\n";
-        return true;
     }
 };
 
-struct GroupNode : ASTNode
+// Everything a single match mutates. A context belongs to one thread and is
+// bound to one pattern; the pattern itself is never written to while
+// matching. Aligned to a cache line so contexts of neighbouring workers
+// don't share one.
+struct alignas(64) MatchContext
 {
-
-    int index;
-    GroupNode(int index) : index(index) {}
-    void print() override
+    std::string_view text;
+    size_t currentChar = 0;
+    size_t startingChar = 0;
+    bool parentIsIgnore = false;
+    bool visitedWhildcard = false;
+    // One slot per group, sized when the context is made. Only groups a
+    // \O{n} selects are recorded, unless captureAll asks for every one.
+    std::vector<GroupIndexe> indexes;
+    bool captureAll = false;
+    // Where the last walk began, before \O{n} moved startingChar.
+    size_t matchStart = 0;
+    Automaton automaton;
+
+    // Starts out as the pattern's budget; stats add up over every search.
+    MatchBudget budget;
+    MatchStats stats;
+    uint32_t stepsToCheck = 0;
+    uint64_t stepsLeft = UINT64_MAX;
+    std::chrono::steady_clock::time_point deadline;
+    bool outOfBudget = false;
+
+    // What the walker learnt about the current record: where sequences of
+    // items fail, and the last run a repetition scanned.
+    FailureMemo failures;
+    std::vector<std::pair<uint32_t, size_t>> trail;
+    char runByte = 0;
+    size_t runStart = 0;
+    size_t runEnd = 0;
+
+    // How much text the pattern's required literal let the engines skip,
+    // and how much they have searched whole since it stopped paying.
+    size_t requiredSkipped = 0;
+    size_t requiredSearched = 0;
+    size_t requiredBypassed = 0;
+
+    // Searches made before the pattern's native code is asked for, and the
+    // code once it has been, null where the walker keeps the pattern.
+    uint32_t jitUses = 0;
+    const JitCode *jit = nullptr;
+
+    MatchContext(const Pattern &pattern);
+
+    // Roughly what the context takes up, the automaton's states included.
+    size_t memory() const
     {
-        std::cout << "()";
+        return sizeof(*this) + automaton.memory() + failures.memory() + indexes.capacity() * sizeof(GroupIndexe) +
+               trail.capacity() * sizeof(trail[0]);
     }
-    bool evaluate() override
-    {
-        int start = currentChar;
-        for (auto &c : children)
-        {
-            if (!c->evaluate())
-            {
-                return false;
-            }
-        }
-        GroupIndexe i;
-        i.start = start;
-        i.end = currentChar;
-        indexes[index] = i;
 
+    bool requiredPays()
+    {
+        if (requiredSearched < 4096 || requiredSearched * 4 < requiredSkipped)
+            return true;
+        if (requiredBypassed < (1 << 20))
+            return false;
+        requiredSkipped = requiredSearched = requiredBypassed = 0;
         return true;
     }
-};
 
-struct WildcardNode : ASTNode
-{
-    void print() override
+    // Called before the walker searches a record, which may not be the one
+    // searched before even at the same address.
+    void startSearch()
     {
-        std::cout << ".";
+        stats.searches++;
+        outOfBudget = false;
+        stepsLeft = budget.steps != 0 ? budget.steps : UINT64_MAX;
+        stepsToCheck = static_cast<uint32_t>(std::min<uint64_t>(stepsLeft, 1024));
+        stepsLeft -= stepsToCheck;
+        if (budget.time.count() != 0)
+            deadline = std::chrono::steady_clock::now() + budget.time;
+        failures.clear();
+        runEnd = 0;
     }
-    bool evaluate() override
+
+    // Length of the run of c at at. Later starts inside a run the search
+    // already scanned reuse its end.
+    size_t runFrom(size_t at, char c)
+    {
+        if (runByte != c || runStart > at || runEnd <= at)
+        {
+            runByte = c;
+            runStart = at;
+            runEnd = at + runLength(text.data() + at, text.size() - at, c);
+        }
+        return runEnd - at;
+    }
+
+    // Hands the walker the next steps of the budget, at most 1024 at a time
+    // so that the clock is read only that often. False once it is spent.
+    __attribute__((noinline)) bool refill()
     {
-        if (currentChar >= text.size())
+        if (stepsLeft == 0 || (budget.time.count() != 0 && std::chrono::steady_clock::now() >= deadline))
         {
+            if (!outOfBudget)
+            {
+                outOfBudget = true;
+                stats.budgetHits++;
+            }
+            stepsLeft = 0;
             return false;
         }
-        visitedWhildcard = true;
-        currentChar++;
+        stepsToCheck = static_cast<uint32_t>(std::min<uint64_t>(stepsLeft, 1024));
+        stepsLeft -= stepsToCheck;
         return true;
     }
 };
 
-struct CounterNode : ASTNode
+int compileLiteral(Nfa &nfa, std::string_view value, int next, bool ignoreCase)
 {
-    int count;
-
-    CounterNode(int count) : count(count) {}
+    for (auto c = value.rbegin(); c != value.rend(); c++)
+    {
+        next = nfa.addByte(Nfa::byteSet(*c, ignoreCase), next);
+    }
+    return next;
+}
 
-    void print() override
+// Operand of * and {n}: its last byte is the one being repeated, compared
+// exactly as it appeared in the text, so each case variant gets its own tail.
+template <typename Tail>
+int compileRepeatedOperand(Nfa &nfa, std::string_view value, bool ignoreCase, Tail tail)
+{
+    unsigned char last = value.back();
+    auto variants = Nfa::byteSet(last, ignoreCase);
+    int entry = -1;
+    for (int b = 0; b < 256; b++)
     {
-        std::cout << "{" << count << "}";
+        if (!variants.test(b))
+            continue;
+        int e = nfa.addByte(Nfa::byteSet(b, false), tail(static_cast<unsigned char>(b)));
+        entry = entry == -1 ? e : nfa.addSplit(entry, e);
     }
-    bool evaluate() override
+    return compileLiteral(nfa, value.substr(0, value.size() - 1), entry, ignoreCase);
+}
+
+// A parsed pattern in one contiguous arena. Nodes are stored in preorder and
+// each records the index one past its subtree, so the children of node i
+// start at i + 1 and every sibling follows at the end of the one before.
+// String literals are ranges of a shared pool. Node 0 is the root.
+struct Tree
+{
+    enum struct Kind : uint8_t
+    {
+        Root,
+        String,
+        Wildcard,
+        Many,
+        Counter,
+        Or,
+        Group,
+        Ignore,
+        GroupSelector
+    };
+
+    struct Node
     {
-        if (!children.front()->evaluate())
+        Kind kind;
+        uint32_t end;
+        // Pool offset of a String, count of a Counter, index of a Group or
+        // selection of a GroupSelector.
+        uint32_t value;
+        // Length of a String; for a Group, nonzero when a \O{n} selects it.
+        uint32_t length;
+    };
+
+    // Largest count a {n} may have.
+    static constexpr uint32_t maxCount = 65535;
+
+    std::vector<Node> nodes;
+    std::string pool;
+    std::string folded;
+    // Items from here on may be reached at one position from different
+    // starts, the only ones the failure memo can save work on.
+    uint32_t memoFrom = 0;
+    // Set when some group isn't selected by any \O{n}, so a walk leaves it
+    // unrecorded.
+    bool elidesGroups = false;
+
+    std::string_view literal(uint32_t node) const
+    {
+        return std::string_view(pool).substr(nodes[node].value, nodes[node].length);
+    }
+
+    void print(uint32_t node, std::ostream &out = std::cout) const
+    {
+        switch (nodes[node].kind)
         {
-            return false;
+        case Kind::Root:
+            out << "Root";
+            break;
+        case Kind::String:
+            out << "\"" << literal(node) << "\"";
+            break;
+        case Kind::Wildcard:
+            out << ".";
+            break;
+        case Kind::Many:
+            out << "*";
+            break;
+        case Kind::Counter:
+            out << "{" << static_cast<int>(nodes[node].value) << "}";
+            break;
+        case Kind::Or:
+            out << "+";
+            break;
+        case Kind::Group:
+            out << "()";
+            break;
+        case Kind::Ignore:
+            out << "\\I";
+            break;
+        case Kind::GroupSelector:
+            out << "\\O{" << nodes[node].value << "}";
+            break;
         }
-        if (visitedWhildcard)
+    }
+
+    // Finds the leftmost match starting at or after startingChar. A failed
+    // attempt may have moved startingChar to a selected group, so the next
+    // start is counted from matchStart.
+    bool evaluate(MatchContext &ctx) const
+    {
+        ctx.matchStart = ctx.startingChar;
+        while (!evaluateRoot(ctx))
         {
-            if (currentChar + count - 1 >= text.size())
+            if (ctx.outOfBudget)
             {
                 return false;
             }
-            currentChar += count - 1;
-            return true;
-        }
-        char c = text[currentChar - 1];
-        for (int i = 0; i < count; i++)
-        {
-            if (currentChar >= text.size())
-                return false;
-            if (text[currentChar] != c)
+#if defined(PATTERN_PROFILE)
+            ctx.stats.nodes[0].rewinds++;
+#endif
+            ctx.matchStart++;
+            ctx.currentChar = ctx.startingChar = ctx.matchStart;
+            if (ctx.startingChar >= ctx.text.size())
             {
                 return false;
             }
-            currentChar++;
         }
         return true;
     }
-};
 
-struct IgnoreNode : ASTNode
-{
-
-    void print() override
+    // Evaluates the pattern once at currentChar, without sliding forward.
+    bool evaluateAnchored(MatchContext &ctx) const
     {
-        std::cout << "\\I";
+        ctx.matchStart = ctx.startingChar = ctx.currentChar;
+        return evaluateRoot(ctx);
     }
-    bool evaluate() override
+
+    // Derives what evaluation needs from the nodes, after parsing or loading.
+    // Only what follows a * or + can be reached at one position from two
+    // starts; before it every item is at a fixed distance from the start.
+    void analyze()
     {
-        //std::cout <<"test\n";
-        parentIsIgnore = true;
-        for (auto &c : children)
+        memoFrom = nodes.size();
+        for (auto &n : nodes)
         {
-            if (!c->evaluate())
+            if (n.kind == Kind::Many || n.kind == Kind::Or)
             {
-                parentIsIgnore = false;
-                return false;
+                memoFrom = n.end;
+                break;
             }
         }
-        parentIsIgnore = false;
-        return true;
+
+        elidesGroups = false;
+        for (auto &group : nodes)
+        {
+            if (group.kind != Kind::Group)
+                continue;
+            group.length = std::any_of(nodes.begin(), nodes.end(), [&](const Node &n)
+                                       { return n.kind == Kind::GroupSelector && n.value == group.value; });
+            elidesGroups |= group.length == 0;
+        }
     }
-};
 
-struct GroupSelectorNode : ASTNode
-{
-    int selction;
+    // Lowers the pattern into nfa. Returns the entry state, or -1 where the
+    // automaton can't match the way the walker does or would outgrow
+    // Nfa::maxStates.
+    int compile(Nfa &nfa) const
+    {
+        return compile(nfa, 0, -1, false);
+    }
 
-    //GroupSelectorNode(int selction) : selction(selction) {}
+private:
+#if defined(PATTERN_PROFILE)
+    bool evaluateRoot(MatchContext &ctx) const
+    {
+        return profiled(ctx, 0, [&]
+                        { return evaluateChildren(ctx, 0); });
+    }
 
-    void print() override
+    bool evaluateNode(MatchContext &ctx, uint32_t node) const
     {
-        std::cout << "\\O{" << selction << "}";
+        return profiled(ctx, node, [&]
+                        { return evaluateUnprofiled(ctx, node); });
     }
 
-    bool evaluate() override
+    template <typename Evaluate>
+    bool profiled(MatchContext &ctx, uint32_t node, Evaluate evaluate) const
     {
-        for (auto &c : children)
-        {
-            if (!c->evaluate())
-            {
-                return false;
-            }
-        }
-        if (selction == 0)
+        size_t at = ctx.currentChar;
+        auto begin = std::chrono::steady_clock::now();
+        bool matched = evaluate();
+        NodeProfile &p = ctx.stats.nodes[node];
+        p.time += std::chrono::steady_clock::now() - begin;
+        p.calls++;
+        if (matched)
         {
-            return true;
+            p.matches++;
+            p.bytes += ctx.currentChar - at;
         }
-        if (indexes.find(selction) == indexes.end())
-        {
-            std::exit(EXIT_FAILURE);
-        }
-        startingChar = indexes[selction].start;
-        currentChar = indexes[selction].end;
-        return true;
+        return matched;
     }
-};
-
-struct StringNode : ASTNode
-{
-    std::string value;
-    StringNode(std::string value) : value(value) {}
-    void print() override
+#else
+    __attribute__((always_inline)) bool evaluateRoot(MatchContext &ctx) const
     {
-        std::cout << "\"" << value << "\"";
+        return evaluateChildren(ctx, 0);
     }
+#endif
 
-    bool evaluate() override
+    bool evaluateChildren(MatchContext &ctx, uint32_t node) const
     {
-        if (currentChar >= text.size())
+        if (nodes[node].end > memoFrom)
         {
-            return false;
+            return evaluateMemoized(ctx, node);
         }
-        for (int i = 0; i < value.size(); i++)
+        for (uint32_t c = node + 1; c < nodes[node].end; c = nodes[c].end)
         {
-            if (value[i] == text[currentChar])
-            {
-                currentChar++;
-            }
-            else if (parentIsIgnore)
+            if (ctx.stepsToCheck == 0 && !ctx.refill())
             {
-                if (tolower(value[i]) == tolower(text[currentChar]))
-                {
-                    currentChar++;
-                }
-                else
-                {
-                    return false;
-                }
+                return false;
             }
-            else
+            ctx.stepsToCheck--;
+            if (!evaluateNode(ctx, c))
             {
                 return false;
             }
         }
         return true;
     }
-};
 
-struct RootNode : ASTNode
-{
-    void print() override
+    // Whether the children from c on match at a position depends on nothing
+    // else, so once they fail there no later start of the search tries them
+    // there again.
+    __attribute__((noinline)) bool evaluateMemoized(MatchContext &ctx, uint32_t node) const
     {
-        std::cout << "Root";
-    }
-    bool evaluate() override
-    {
-    RETRY:
-        for (auto &c : children)
+        size_t trail = ctx.trail.size();
+        for (uint32_t c = node + 1; c < nodes[node].end; c = nodes[c].end)
         {
-            if (!c->evaluate())
+            if (ctx.stepsToCheck == 0 && !ctx.refill())
+            {
+                return fail(ctx, trail);
+            }
+            ctx.stepsToCheck--;
+            if (c >= memoFrom)
             {
-                currentChar++;
-                startingChar = currentChar;
-                if (startingChar >= text.size())
+                uint64_t key = ctx.currentChar * nodes.size() + c;
+                if (ctx.failures.contains(key))
                 {
-                    return false;
+                    ctx.stats.memoHits++;
+#if defined(PATTERN_PROFILE)
+                    ctx.stats.nodes[c].memoHits++;
+#endif
+                    return fail(ctx, trail);
                 }
-                goto RETRY;
+                ctx.trail.push_back({c, ctx.currentChar});
+            }
+            if (!evaluateNode(ctx, c))
+            {
+                return fail(ctx, trail);
             }
-            // std::cout << "\"" << text[currentChar] << "\"\n";
         }
+        ctx.trail.resize(trail);
         return true;
     }
-};
 
-class Parser
-{
-private:
-    std::vector<Token> tokens;
-    int currentToken = 0;
-
-    std::unique_ptr<ASTNode> tryBuildString()
+    bool fail(MatchContext &ctx, size_t trail) const
     {
-        Token *t = getToken(Token::Type::String);
-
-        if (t == nullptr)
+        if (!ctx.outOfBudget)
         {
-            return nullptr;
+            for (size_t i = trail; i < ctx.trail.size(); i++)
+                ctx.failures.insert(ctx.trail[i].second * nodes.size() + ctx.trail[i].first);
         }
-
-        return std::make_unique<StringNode>(t->value);
+        ctx.trail.resize(trail);
+        return false;
     }
 
-    std::unique_ptr<ASTNode> tryBuildWildcard()
+#if defined(PATTERN_PROFILE)
+    bool evaluateUnprofiled(MatchContext &ctx, uint32_t node) const
+#else
+    bool evaluateNode(MatchContext &ctx, uint32_t node) const
+#endif
     {
-        Token *t = getToken(Token::Type::Wildcard);
-
-        if (t == nullptr)
+        const Node &n = nodes[node];
+        switch (n.kind)
         {
-            return nullptr;
-        }
-
-        return std::make_unique<WildcardNode>();
-    }
-
-    std::unique_ptr<ASTNode> tryBuildCounter()
-    {
-        int checkpoint = currentToken;
-
-        auto operand = tryBuildOperand();
-
-        if (operand == nullptr)
+        case Kind::String:
         {
-            return nullptr;
+            if (ctx.currentChar >= ctx.text.size() || ctx.text.size() - ctx.currentChar < n.length)
+            {
+                return false;
+            }
+            const char *at = ctx.text.data() + ctx.currentChar;
+            if (ctx.parentIsIgnore ? !equalsFolded(at, folded.data() + n.value, n.length)
+                                   : std::memcmp(at, pool.data() + n.value, n.length) != 0)
+            {
+                return false;
+            }
+            ctx.currentChar += n.length;
+            return true;
         }
-
-        Token *t = getToken(Token::Type::Counter);
-
-        if (t == nullptr)
+        case Kind::Wildcard:
         {
-            currentToken = checkpoint;
-            return nullptr;
+            if (ctx.currentChar >= ctx.text.size())
+            {
+                return false;
+            }
+            ctx.visitedWhildcard = true;
+            ctx.currentChar++;
+            return true;
+        }
+        default:
+            return evaluateComposite(ctx, node);
         }
-
-        auto counter = std::make_unique<CounterNode>(std::stoi(t->value));
-        counter->children.push_back(std::move(operand));
-        return counter;
     }
 
-    std::unique_ptr<ASTNode> tryBuildMany()
+    // Kept out of line so matching a leaf, by far the most common node,
+    // doesn't pay for the registers the composite cases need.
+    __attribute__((noinline)) bool evaluateComposite(MatchContext &ctx, uint32_t node) const
     {
-        int checkpoint = currentToken;
-
-        auto operand = tryBuildOperand();
-
-        if (operand == nullptr)
+        const Node &n = nodes[node];
+        switch (n.kind)
         {
-            return nullptr;
-        }
-
-        Token *t = getToken(Token::Type::Many);
-
-        if (t == nullptr)
+        case Kind::Many:
         {
-            currentToken = checkpoint;
-            return nullptr;
+            ctx.visitedWhildcard = false;
+            if (!evaluateNode(ctx, node + 1))
+            {
+                return false;
+            }
+            if (ctx.visitedWhildcard)
+            {
+                ctx.currentChar = ctx.text.size();
+                ctx.visitedWhildcard = false;
+                return true;
+            }
+            size_t run = ctx.runFrom(ctx.currentChar, ctx.text[ctx.currentChar - 1]);
+            if (run == 0)
+            {
+                return false;
+            }
+            ctx.currentChar += run;
+            return true;
         }
-
-        auto many = std::make_unique<ManyNode>();
-        many->children.push_back(std::move(operand));
-
-        return many;
-    }
-
-    std::unique_ptr<ASTNode> tryBuildOr()
-    {
-        int chekpoint = currentToken;
-
-        auto lhs = tryBuildOperand();
-
-        if (lhs == nullptr)
+        case Kind::Counter:
         {
-            return nullptr;
+            int count = static_cast<int>(n.value);
+            ctx.visitedWhildcard = false;
+            if (!evaluateNode(ctx, node + 1))
+            {
+                return false;
+            }
+            if (ctx.visitedWhildcard)
+            {
+                ctx.visitedWhildcard = false;
+                if (ctx.currentChar + count - 1 > ctx.text.size())
+                {
+                    return false;
+                }
+                ctx.currentChar += count - 1;
+                return true;
+            }
+            char c = ctx.text[ctx.currentChar - 1];
+            if (ctx.text.size() - ctx.currentChar < static_cast<size_t>(count) ||
+                runLength(ctx.text.data() + ctx.currentChar, count, c) != static_cast<size_t>(count))
+            {
+                return false;
+            }
+            ctx.currentChar += count;
+            return true;
         }
-
-        Token *t = getToken(Token::Type::Or);
-
-        if (t == nullptr)
+        case Kind::Or:
         {
-            currentToken = chekpoint;
-            return nullptr;
+            size_t checkpoint = ctx.currentChar;
+            bool lhsSuccsess = evaluateNode(ctx, node + 1);
+            size_t lhsEnd = ctx.currentChar;
+            ctx.currentChar = checkpoint;
+#if defined(PATTERN_PROFILE)
+            ctx.stats.nodes[node].rewinds++;
+#endif
+            bool rhsSuccess = evaluateNode(ctx, nodes[node + 1].end);
+            size_t rhsEnd = ctx.currentChar;
+            if (lhsSuccsess == rhsSuccess)
+            {
+                ctx.currentChar = lhsEnd > rhsEnd ? lhsEnd : rhsEnd;
+                return lhsSuccsess;
+            }
+            ctx.currentChar = lhsSuccsess ? lhsEnd : rhsEnd;
+            return true;
         }
-
-        auto rhs = tryBuildOperand();
-
-        if (rhs == nullptr)
+        case Kind::Group:
         {
-            currentToken = chekpoint;
-            return nullptr;
+            size_t start = ctx.currentChar;
+            if (!evaluateChildren(ctx, node))
+            {
+                return false;
+            }
+            if (n.length != 0 || ctx.captureAll)
+            {
+                ctx.indexes[n.value] = {start, ctx.currentChar};
+            }
+            return true;
         }
-
-        auto orNode = std::make_unique<OrNode>();
-
-        orNode->children.push_back(std::move(lhs));
-        orNode->children.push_back(std::move(rhs));
-        return orNode;
-    }
-
-    std::unique_ptr<ASTNode> tryBuildOperand()
-    {
-        auto p = tryBuildString();
-        if (p != nullptr)
+        case Kind::Ignore:
         {
-            return p;
+            ctx.parentIsIgnore = true;
+            bool success = evaluateChildren(ctx, node);
+            ctx.parentIsIgnore = false;
+            return success;
         }
-        else if ((p = tryBuildWildcard()); p != nullptr)
+        case Kind::GroupSelector:
         {
-            return p;
+            if (!evaluateChildren(ctx, node))
+            {
+                return false;
+            }
+            if (n.value == 0)
+            {
+                return true;
+            }
+            if (n.value >= ctx.indexes.size() || ctx.indexes[n.value].start == std::string::npos)
+            {
+                return false;
+            }
+            ctx.startingChar = ctx.indexes[n.value].start;
+            ctx.currentChar = ctx.indexes[n.value].end;
+            return true;
         }
-        else
-        {
-            return nullptr;
+        case Kind::Root:
+            return evaluateChildren(ctx, node);
+        default:
+            return false;
         }
     }
 
-    std::unique_ptr<ASTNode> tryBuildOperator()
+    // Children are lowered back to front, since each continues into the next.
+    int compileChildren(Nfa &nfa, uint32_t child, uint32_t end, int next, bool ignoreCase) const
     {
-        auto p = tryBuildOr();
-        if (p != nullptr)
+        if (child == end)
         {
-            return p;
+            return next;
         }
-        else if ((p = tryBuildMany()); p != nullptr)
+        int rest = compileChildren(nfa, nodes[child].end, end, next, ignoreCase);
+        return rest < 0 ? rest : compile(nfa, child, rest, ignoreCase);
+    }
+
+    uint32_t operandLength(uint32_t node) const
+    {
+        return nodes[node].kind == Kind::Wildcard ? 1 : nodes[node].length;
+    }
+
+    // Byte i of an operand of +, as the automaton reads it.
+    std::bitset<256> operandByte(uint32_t node, size_t i, bool ignoreCase) const
+    {
+        auto bytes = nodes[node].kind == Kind::Wildcard ? Nfa::anyByte() : Nfa::byteSet(literal(node)[i], ignoreCase);
+        return bytes.reset(recordSeparator);
+    }
+
+    // The walker commits to the operand of + that reaches further, the left
+    // one on a tie, and never comes back for the other. So the shorter one
+    // may only be taken where the longer fails: its bytes either stray from
+    // the longer's as they are read, or the byte after them doesn't go on
+    // with it. Returns -1 where that needs more than one byte of lookahead
+    // and something still follows the +.
+    int compileOr(Nfa &nfa, uint32_t node, int next, bool ignoreCase) const
+    {
+        uint32_t lhs = node + 1;
+        uint32_t rhs = nodes[lhs].end;
+        uint32_t longer = operandLength(rhs) > operandLength(lhs) ? rhs : lhs;
+        uint32_t shorter = longer == lhs ? rhs : lhs;
+        size_t shortLength = operandLength(shorter);
+        size_t longLength = operandLength(longer);
+        int taken = compile(nfa, longer, next, ignoreCase);
+
+        bool overlaps = shortLength < longLength;
+        for (size_t i = 0; overlaps && i < shortLength; i++)
+            overlaps = (operandByte(shorter, i, ignoreCase) & operandByte(longer, i, ignoreCase)).any();
+        if (!overlaps || nfa.states[next].type == NfaState::Type::Match)
         {
-            return p;
+            return nfa.addSplit(taken, compile(nfa, shorter, next, ignoreCase));
         }
-        else if ((p = tryBuildCounter()); p != nullptr)
+        if (longLength - shortLength > 1)
         {
-            return p;
+            return -1;
         }
-        else
+
+        int along = nfa.addNotFollowedBy(operandByte(longer, shortLength, ignoreCase), next);
+        int strayed = next;
+        for (size_t i = shortLength; i-- > 0;)
         {
-            return nullptr;
+            auto own = operandByte(shorter, i, ignoreCase);
+            auto theirs = operandByte(longer, i, ignoreCase);
+            along = nfa.addSplit(nfa.addByte(own & theirs, along), nfa.addByte(own & ~theirs, strayed));
+            strayed = nfa.addByte(own, strayed);
         }
+        return nfa.addSplit(taken, along);
     }
 
-    std::vector<std::unique_ptr<ASTNode>> tryBuildExpression()
+    int compile(Nfa &nfa, uint32_t node, int next, bool ignoreCase) const
     {
-        std::vector<std::unique_ptr<ASTNode>> children;
-        while (!isEnd())
+        const Node &n = nodes[node];
+        switch (n.kind)
         {
-            if (tokens[currentToken].type == Token::Type::Ignore || tokens[currentToken].type == Token::Type::GroupSelector)
-            {
-                break;
-            }
-            auto p = tryBuildGroup();
-            if (p != nullptr)
-            {
-                children.push_back(std::move(p));
-            }
-            else if ((p = tryBuildOperator()); p != nullptr)
+        case Kind::Root:
+            return compileChildren(nfa, node + 1, n.end, nfa.addMatch(), false);
+        case Kind::String:
+            return compileLiteral(nfa, literal(node), next, ignoreCase);
+        case Kind::Wildcard:
+            return nfa.addByte(Nfa::anyByte(), next);
+        case Kind::Many:
+        {
+            if (nodes[node + 1].kind == Kind::Wildcard)
             {
-                children.push_back(std::move(p));
+                int loop = nfa.addSplit(-1, nfa.addAtEnd(next));
+                nfa.states[loop].out = nfa.addByte(Nfa::anyByte(), loop);
+                return nfa.addByte(Nfa::anyByte(), loop);
             }
-            else if ((p = tryBuildOperand()); p != nullptr)
+            return compileRepeatedOperand(nfa, literal(node + 1), ignoreCase, [&](unsigned char c)
+                                          {
+                                              int loop = nfa.addSplit(-1, nfa.addNotFollowedBy(Nfa::byteSet(c, false), next));
+                                              nfa.states[loop].out = nfa.addByte(Nfa::byteSet(c, false), loop);
+                                              return nfa.addByte(Nfa::byteSet(c, false), loop);
+                                          });
+        }
+        case Kind::Counter:
+        {
+            int count = static_cast<int>(n.value);
+            // Every repetition is a state of its own, per case variant.
+            if (nfa.states.size() + 2 * static_cast<size_t>(count) > Nfa::maxStates)
             {
-                children.push_back(std::move(p));
+                return -1;
             }
-            else
+            if (nodes[node + 1].kind == Kind::Wildcard)
             {
-                std::exit(EXIT_FAILURE);
+                for (int i = 0; i < std::max(count, 1); i++)
+                {
+                    next = nfa.addByte(Nfa::anyByte(), next);
+                }
+                return next;
             }
+            return compileRepeatedOperand(nfa, literal(node + 1), ignoreCase, [&](unsigned char c)
+                                          {
+                                              int tail = next;
+                                              for (int i = 0; i < count; i++)
+                                              {
+                                                  tail = nfa.addByte(Nfa::byteSet(c, false), tail);
+                                              }
+                                              return tail;
+                                          });
         }
-
-        return children;
+        case Kind::Or:
+            return compileOr(nfa, node, next, ignoreCase);
+        case Kind::Ignore:
+            return compileChildren(nfa, node + 1, n.end, next, true);
+        case Kind::Group:
+        case Kind::GroupSelector:
+            return compileChildren(nfa, node + 1, n.end, next, ignoreCase);
+        }
+        return next;
     }
+};
 
-    std::unique_ptr<ASTNode> tryBuildGroupSelector()
+// Builds the Tree in one pass over the tokens with one token of lookahead.
+//
+//   pattern   := item+, where \I wraps the items since the last \I or \O
+//                and \O{n} wraps the items since the last \O
+//   item      := operation | '(' operation* ')'
+//   operation := operand ['+' operand | '*' | '{n}']
+//   operand   := string | '.'
+//
+// Nodes are appended in preorder. \I and \O{n} follow what they apply to,
+// so their node is inserted in front of it; every node is moved by at most
+// those two, which keeps parsing linear in the length of the pattern.
+class Parser
+{
+private:
+    std::vector<Token> tokens;
+    size_t currentToken = 0;
+    int groupCount = 0;
+    bool hasBuiltGroupSelector = false;
+    Tree tree;
+    PatternError error;
+
+    bool fail(size_t offset, std::string message)
     {
-        int checkpoint = currentToken;
-        auto isGroupeEnd = [](Token t)
-        { return t.type == Token::Type::CloseParan; };
+        error = {offset, std::move(message)};
+        return false;
+    }
 
-        auto stop = std::find_if(tokens.begin(), tokens.end(), isGroupeEnd);
-        if (stop == tokens.end())
-        {
-            currentToken = checkpoint;
-            return nullptr;
-        }
+    // Appends a node; its subtree is whatever is appended until close().
+    size_t open(Tree::Kind kind, uint32_t value = 0)
+    {
+        tree.nodes.push_back({kind, 0, value, 0});
+        return tree.nodes.size() - 1;
+    }
 
-        std::vector<std::unique_ptr<ASTNode>> c;
-        auto selector = std::make_unique<GroupSelectorNode>();
-        while (!isEnd())
-        {
-            if (tokens[currentToken].type == Token::Type::GroupSelector)
-                break;
-            auto p = tryBuildIgnore();
-            if (p != nullptr)
-            {
-                selector->children.push_back(std::move(p));
-            }
-            else if ((c = tryBuildExpression()); !c.empty())
-            {
-                selector->children.insert(selector->children.end(),
-                                          std::make_move_iterator(c.begin()),
-                                          std::make_move_iterator(c.end()));
-            }
-        }
-        auto t = getToken(Token::Type::GroupSelector);
-        if (t == nullptr)
-        {
-            currentToken = checkpoint;
-            return nullptr;
-        }
+    void close(size_t node)
+    {
+        tree.nodes[node].end = tree.nodes.size();
+    }
 
-        selector->selction = std::stoi(t->value);
+    // Makes the nodes from first on the children of a new node.
+    void wrap(size_t first, Tree::Kind kind, uint32_t value)
+    {
+        for (size_t i = first; i < tree.nodes.size(); i++)
+            tree.nodes[i].end++;
+        tree.nodes.insert(tree.nodes.begin() + first, {kind, static_cast<uint32_t>(tree.nodes.size() + 1), value, 0});
+    }
 
-        hasBuiltGroupSelector = true;
+    bool isEnd() const
+    {
+        return currentToken >= tokens.size();
+    }
 
-        return selector;
+    const Token *peek() const
+    {
+        return isEnd() ? nullptr : &tokens[currentToken];
     }
 
-    std::unique_ptr<ASTNode> tryBuildIgnore()
+    bool readNumber(const Token &t, uint32_t &number)
     {
-        int checkpoint = currentToken;
-        auto c = tryBuildExpression();
-        if (c.empty())
+        if (t.value.empty() || t.value.size() > 9 ||
+            std::any_of(t.value.begin(), t.value.end(), [](char c)
+                        { return c < '0' || c > '9'; }))
         {
-            currentToken = checkpoint;
-            return nullptr;
+            return fail(t.offset, "expected a number of at most 9 digits in {}");
         }
-        auto p = getToken(Token::Type::Ignore);
+        number = 0;
+        for (char c : t.value)
+            number = number * 10 + (c - '0');
+        return true;
+    }
+
+    bool isOperand(const Token *t) const
+    {
+        return t != nullptr && (t->type == Token::Type::String || t->type == Token::Type::Wildcard);
+    }
 
-        if (p == nullptr)
+    void buildOperand(const Token &t)
+    {
+        if (t.type == Token::Type::Wildcard)
         {
-            currentToken = checkpoint;
-            return nullptr;
+            close(open(Tree::Kind::Wildcard));
+            return;
         }
-        auto ignore = std::make_unique<IgnoreNode>();
-        ignore->children.insert(ignore->children.end(),
-                                std::make_move_iterator(c.begin()),
-                                std::make_move_iterator(c.end()));
-        return ignore;
+        size_t node = open(Tree::Kind::String, tree.pool.size());
+        tree.nodes[node].length = t.value.size();
+        tree.pool += t.value;
+        close(node);
     }
 
-    std::unique_ptr<ASTNode> tryBuildGroup()
+    bool buildOperation()
     {
-        static int groupIndex = 1;
-        int checkpoint = currentToken;
-        auto t = getToken(Token::Type::OpenParan);
-        if (t == nullptr)
+        const Token &operand = tokens[currentToken++];
+        const Token *op = peek();
+        if (op == nullptr)
+        {
+            buildOperand(operand);
+            return true;
+        }
+
+        switch (op->type)
+        {
+        case Token::Type::Or:
         {
-            return nullptr;
+            currentToken++;
+            const Token *rhs = peek();
+            if (!isOperand(rhs))
+            {
+                return fail(op->offset, "expected a string or '.' after '+'");
+            }
+            currentToken++;
+            size_t orNode = open(Tree::Kind::Or);
+            buildOperand(operand);
+            buildOperand(*rhs);
+            close(orNode);
+            return true;
+        }
+        case Token::Type::Many:
+        {
+            currentToken++;
+            size_t many = open(Tree::Kind::Many);
+            buildOperand(operand);
+            close(many);
+            return true;
+        }
+        case Token::Type::Counter:
+        {
+            uint32_t count;
+            if (!readNumber(*op, count))
+            {
+                return false;
+            }
+            if (count > Tree::maxCount)
+            {
+                return fail(op->offset, "{n} repeats at most " + std::to_string(Tree::maxCount) + " times");
+            }
+            currentToken++;
+            size_t counter = open(Tree::Kind::Counter, count);
+            buildOperand(operand);
+            close(counter);
+            return true;
         }
-        auto group = std::make_unique<GroupNode>(groupIndex);
-        while (tokens[currentToken].type != Token::Type::CloseParan)
+        default:
+            buildOperand(operand);
+            return true;
+        }
+    }
+
+    bool buildGroup()
+    {
+        const Token &paren = tokens[currentToken++];
+        size_t group = open(Tree::Kind::Group, ++groupCount);
+        while (true)
         {
-            if (isEnd())
+            const Token *t = peek();
+            if (t == nullptr)
             {
-                std::exit(EXIT_FAILURE);
+                return fail(paren.offset, "missing ')'");
             }
-            auto p = tryBuildOperator();
-            if (p != nullptr)
+            if (t->type == Token::Type::CloseParan)
             {
-                group->children.push_back(std::move(p));
+                break;
             }
-            else if ((p = tryBuildOperand()); p != nullptr)
+            if (!isOperand(t))
             {
-                group->children.push_back(std::move(p));
+                return fail(t->offset, t->type == Token::Type::OpenParan ? "groups cannot be nested"
+                                                                          : "expected a string, '.' or ')'");
             }
-            else
+            if (!buildOperation())
             {
-                std::exit(EXIT_FAILURE);
+                return false;
             }
         }
         currentToken++;
-        groupIndex++;
-        return group;
+        close(group);
+        return true;
     }
 
-    bool isEnd() const
+public:
+    Parser(std::vector<Token> tokens) : tokens(std::move(tokens))
     {
-        return currentToken >= tokens.size();
     }
 
-    Token *getToken(Token::Type type)
+    int getGroupCount() const
     {
-        if (isEnd())
-        {
-            return nullptr;
-        }
-        if (tokens[currentToken].type == type)
-        {
-            return &tokens[currentToken++];
-        }
-        return nullptr;
+        return groupCount;
     }
 
-public:
-    Parser(std::vector<Token> tokens) : tokens(tokens)
+    bool getHasGroupSelector() const
+    {
+        return hasBuiltGroupSelector;
+    }
+
+    Tree &getTree()
+    {
+        return tree;
+    }
+
+    const PatternError &getError() const
     {
+        return error;
     }
 
-    std::unique_ptr<ASTNode> parse()
+    bool parse()
     {
         if (isEnd())
         {
-            return nullptr;
+            return fail(0, "empty pattern");
         }
-        std::unique_ptr<ASTNode> root = std::make_unique<RootNode>();
 
+        // Every token adds at most one node.
+        size_t literals = 0;
+        for (auto &t : tokens)
+        {
+            if (t.type == Token::Type::String)
+                literals += t.value.size();
+        }
+        tree.nodes.reserve(tokens.size() + 1);
+        tree.pool.reserve(literals);
+
+        size_t root = open(Tree::Kind::Root);
+        size_t selectorStart = tree.nodes.size();
+        size_t ignoreStart = selectorStart;
+        int selectorGroups = groupCount;
         while (!isEnd())
         {
-            std::vector<std::unique_ptr<ASTNode>> c;
-            auto p = tryBuildGroupSelector();
-            if (p != nullptr)
-            {
-                root->children.push_back(std::move(p));
-            }
-            else if ((p = tryBuildIgnore()); p != nullptr)
+            const Token &t = tokens[currentToken];
+            switch (t.type)
             {
-                root->children.push_back(std::move(p));
-            }
-            else if ((c = tryBuildExpression()); !c.empty())
+            case Token::Type::String:
+            case Token::Type::Wildcard:
+                if (!buildOperation())
+                {
+                    return false;
+                }
+                break;
+            case Token::Type::OpenParan:
+                if (!buildGroup())
+                {
+                    return false;
+                }
+                break;
+            case Token::Type::Ignore:
+                if (ignoreStart == tree.nodes.size())
+                {
+                    return fail(t.offset, "nothing before \\I to apply it to");
+                }
+                wrap(ignoreStart, Tree::Kind::Ignore, 0);
+                currentToken++;
+                ignoreStart = tree.nodes.size();
+                break;
+            case Token::Type::GroupSelector:
             {
-                root->children.insert(root->children.end(),
-                                      std::make_move_iterator(c.begin()),
-                                      std::make_move_iterator(c.end()));
+                uint32_t selection;
+                if (!readNumber(t, selection))
+                {
+                    return false;
+                }
+                if (selectorStart == tree.nodes.size())
+                {
+                    return fail(t.offset, "nothing before \\O{n} to select from");
+                }
+                // Only a group inside the selector is certain to be set
+                // whenever the selector matches.
+                if (selection != 0 && (selection <= static_cast<uint32_t>(selectorGroups) ||
+                                       selection > static_cast<uint32_t>(groupCount)))
+                {
+                    return fail(t.offset, "\\O{" + std::to_string(selection) + "} selects no group before it");
+                }
+                wrap(selectorStart, Tree::Kind::GroupSelector, selection);
+                hasBuiltGroupSelector = true;
+                currentToken++;
+                selectorStart = ignoreStart = tree.nodes.size();
+                selectorGroups = groupCount;
+                break;
             }
-            else
-            {
-                return nullptr;
+            case Token::Type::CloseParan:
+                return fail(t.offset, "')' without '('");
+            default:
+                return fail(t.offset, std::string(t.type == Token::Type::Or     ? "'+'"
+                                                  : t.type == Token::Type::Many ? "'*'"
+                                                                                : "{n}") +
+                                          " needs a string or '.' before it");
             }
         }
+        close(root);
+        tree.folded = foldCase(tree.pool);
+        tree.analyze();
 
-        return root;
+        return true;
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,692 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include "giggaTree.hpp"
+#include "runLength.hpp"
+
+// Where compiled code matched. start is SIZE_MAX when it didn't.
+struct JitMatch
+{
+    size_t start;
+    size_t end;
+};
+
+#if defined(__x86_64__)
+// Called from compiled code, which passes bytes zero-extended.
+size_t jitRun(MatchContext *ctx, size_t at, unsigned c)
+{
+    return ctx->runFrom(at, static_cast<char>(c));
+}
+
+size_t jitRunLength(const char *text, size_t n, unsigned c)
+{
+    return runLength(text, n, static_cast<char>(c));
+}
+
+// Whether the items from item on are known to fail at at, keyed as
+// Tree::evaluateMemoized() keys them. If not, they are noted as tried there.
+// Nothing may throw through compiled code, which has no unwind tables.
+size_t jitKnownToFail(MatchContext *ctx, size_t at, uint32_t item, size_t nodes) noexcept
+{
+    if (ctx->failures.contains(at * nodes + item))
+    {
+        ctx->stats.memoHits++;
+        return 1;
+    }
+    ctx->trail.push_back({item, at});
+    return 0;
+}
+
+// A sequence matched, so the last tried of its items say nothing.
+void jitMatched(MatchContext *ctx, size_t tried) noexcept
+{
+    ctx->trail.resize(ctx->trail.size() - tried);
+}
+
+// The start failed, so everything it tried fails where it was tried.
+void jitFailed(MatchContext *ctx, size_t nodes) noexcept
+{
+    for (auto &[item, at] : ctx->trail)
+        ctx->failures.insert(at * nodes + item);
+    ctx->trail.clear();
+}
+
+// Just enough of x86-64 to encode what JitCompiler emits. Jumps always take
+// a 32-bit displacement and are patched once the code is complete.
+class Assembler
+{
+public:
+    enum Register
+    {
+        rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+        r8, r9, r10, r11, r12, r13, r14, r15
+    };
+
+    enum Condition
+    {
+        Below = 0x2,
+        AboveOrEqual = 0x3,
+        Equal = 0x4,
+        NotEqual = 0x5,
+        Above = 0x7
+    };
+
+    std::vector<uint8_t> code;
+
+    int label()
+    {
+        labels.push_back(SIZE_MAX);
+        return static_cast<int>(labels.size() - 1);
+    }
+
+    void bind(int l)
+    {
+        labels[l] = code.size();
+    }
+
+    void jump(int l)
+    {
+        byte(0xE9);
+        fixup(l);
+    }
+
+    void jump(Condition cc, int l)
+    {
+        byte(0x0F);
+        byte(0x80 | cc);
+        fixup(l);
+    }
+
+    // Resolves every jump. False if one targets a label never bound.
+    bool link()
+    {
+        for (auto &f : fixups)
+        {
+            if (labels[f.label] == SIZE_MAX)
+                return false;
+            int32_t rel = static_cast<int32_t>(labels[f.label] - (f.at + 4));
+            std::memcpy(code.data() + f.at, &rel, 4);
+        }
+        return true;
+    }
+
+    void push(Register r)
+    {
+        if (r >= r8)
+            byte(0x41);
+        byte(0x50 | (r & 7));
+    }
+
+    void pop(Register r)
+    {
+        if (r >= r8)
+            byte(0x41);
+        byte(0x58 | (r & 7));
+    }
+
+    void ret()
+    {
+        byte(0xC3);
+    }
+
+    void mov(Register dst, Register src)
+    {
+        registers(0x89, src, dst);
+    }
+
+    void add(Register dst, Register src)
+    {
+        registers(0x01, src, dst);
+    }
+
+    void sub(Register dst, Register src)
+    {
+        registers(0x29, src, dst);
+    }
+
+    void cmp(Register lhs, Register rhs)
+    {
+        registers(0x39, rhs, lhs);
+    }
+
+    void test(Register lhs, Register rhs)
+    {
+        registers(0x85, rhs, lhs);
+    }
+
+    void orq(Register dst, Register src)
+    {
+        registers(0x09, src, dst);
+    }
+
+    // dst = src when the last compare found its lhs below its rhs.
+    void cmovb(Register dst, Register src)
+    {
+        rex(true, dst, src);
+        byte(0x0F);
+        byte(0x42);
+        byte(0xC0 | (dst & 7) << 3 | (src & 7));
+    }
+
+    // Zeroes all 64 bits.
+    void zero(Register r)
+    {
+        if (r >= r8)
+            byte(0x45);
+        byte(0x31);
+        byte(0xC0 | (r & 7) << 3 | (r & 7));
+    }
+
+    void mov(Register dst, uint64_t value)
+    {
+        if (value <= UINT32_MAX)
+        {
+            // Writing the low half zeroes the rest.
+            if (dst >= r8)
+                byte(0x41);
+            byte(0xB8 | (dst & 7));
+            imm32(static_cast<uint32_t>(value));
+            return;
+        }
+        rex(true, rax, dst);
+        byte(0xB8 | (dst & 7));
+        std::memcpy(grow(8), &value, 8);
+    }
+
+    void add(Register dst, uint32_t value)
+    {
+        immediate(true, 0, dst, value);
+    }
+
+    void sub(Register dst, uint32_t value)
+    {
+        immediate(true, 5, dst, value);
+    }
+
+    void cmp(Register lhs, uint32_t value)
+    {
+        immediate(true, 7, lhs, value);
+    }
+
+    // 32-bit forms, for the low half of a register.
+    void or32(Register dst, uint32_t value)
+    {
+        immediate(false, 1, dst, value);
+    }
+
+    void cmp32(Register lhs, uint32_t value)
+    {
+        immediate(false, 7, lhs, value);
+    }
+
+    void inc(Register r)
+    {
+        rex(true, rax, r);
+        byte(0xFF);
+        byte(0xC0 | (r & 7));
+    }
+
+    // dst = base + disp, for a base other than rsp and r12.
+    void lea(Register dst, Register base, int32_t disp)
+    {
+        rex(true, dst, base);
+        byte(0x8D);
+        byte(0x80 | (dst & 7) << 3 | (base & 7));
+        imm32(static_cast<uint32_t>(disp));
+    }
+
+    // dst = the width bytes at [base + index + disp], zero-extended.
+    void load(Register dst, Register base, Register index, int32_t disp, int width)
+    {
+        if (width == 2)
+            indexed(false, {0x0F, 0xB7}, dst, base, index, disp);
+        else if (width == 1)
+            indexed(false, {0x0F, 0xB6}, dst, base, index, disp);
+        else
+            indexed(width == 8, {0x8B}, dst, base, index, disp);
+    }
+
+    // dst = base + index + disp.
+    void lea(Register dst, Register base, Register index, int32_t disp)
+    {
+        indexed(true, {0x8D}, dst, base, index, disp);
+    }
+
+    void call(const void *function)
+    {
+        mov(rax, reinterpret_cast<uint64_t>(function));
+        byte(0xFF);
+        byte(0xD0);
+    }
+
+private:
+    struct Fixup
+    {
+        size_t at;
+        int label;
+    };
+
+    std::vector<size_t> labels;
+    std::vector<Fixup> fixups;
+
+    void byte(uint8_t b)
+    {
+        code.push_back(b);
+    }
+
+    uint8_t *grow(size_t n)
+    {
+        code.resize(code.size() + n);
+        return code.data() + code.size() - n;
+    }
+
+    void imm32(uint32_t value)
+    {
+        std::memcpy(grow(4), &value, 4);
+    }
+
+    void fixup(int l)
+    {
+        fixups.push_back({code.size(), l});
+        imm32(0);
+    }
+
+    void rex(bool wide, Register reg, Register rm, Register index = rax)
+    {
+        uint8_t prefix = 0x40 | (wide ? 8 : 0) | (reg >= r8 ? 4 : 0) | (index >= r8 ? 2 : 0) | (rm >= r8 ? 1 : 0);
+        if (prefix != 0x40)
+            byte(prefix);
+    }
+
+    void registers(uint8_t opcode, Register reg, Register rm)
+    {
+        rex(true, reg, rm);
+        byte(opcode);
+        byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+    }
+
+    void immediate(bool wide, int operation, Register rm, uint32_t value)
+    {
+        rex(wide, rax, rm);
+        byte(0x81);
+        byte(0xC0 | operation << 3 | (rm & 7));
+        imm32(value);
+    }
+
+    void indexed(bool wide, std::initializer_list<uint8_t> opcode, Register reg, Register base, Register index,
+                 int32_t disp)
+    {
+        rex(wide, reg, base, index);
+        for (uint8_t b : opcode)
+            byte(b);
+        byte(0x84 | (reg & 7) << 3);
+        byte((index & 7) << 3 | (base & 7));
+        imm32(static_cast<uint32_t>(disp));
+    }
+};
+
+// Lowers a tree into one function that does what Tree::evaluate() does from
+// first to last, so the walk over the nodes is paid once, here. Registers
+// hold the walker's state for the whole search:
+//   r15  the context, for the run cache and the failure memo
+//   r12  the text, r13 its size
+//   rbx  the start being tried, rbp the last start to try
+//   r14  currentChar
+// all preserved across the helpers called for runs. Whether strings compare
+// folded is known at every node, since \I sets it on entry and clears it on
+// exit and its subtrees are sequences. The operands of repetitions and of +
+// are single strings or '.', so none of them moves currentChar before
+// knowing it matches.
+class JitCompiler
+{
+private:
+    using A = Assembler;
+
+    const Tree &tree;
+    Assembler a;
+
+    static bool isLeaf(const Tree::Node &n)
+    {
+        return n.kind == Tree::Kind::String || n.kind == Tree::Kind::Wildcard;
+    }
+
+    // How far a leaf moves currentChar when it matches.
+    static uint32_t width(const Tree::Node &n)
+    {
+        return n.kind == Tree::Kind::String ? n.length : 1;
+    }
+
+    // Jumps to fail unless the leaf matches at currentChar, which it leaves
+    // where it was. Literals are compared 8, 4, 2 and 1 bytes at a time
+    // against immediates; folded, the letters of a word are ORed with 0x20
+    // first, which folds them exactly as foldByte() does.
+    void check(uint32_t node, bool fold, int fail)
+    {
+        const Tree::Node &n = tree.nodes[node];
+        if (n.kind == Tree::Kind::Wildcard)
+        {
+            a.cmp(A::r14, A::r13);
+            a.jump(A::AboveOrEqual, fail);
+            return;
+        }
+        a.mov(A::rax, A::r13);
+        a.sub(A::rax, A::r14);
+        a.cmp(A::rax, n.length);
+        a.jump(A::Below, fail);
+
+        const char *literal = (fold ? tree.folded.data() : tree.pool.data()) + n.value;
+        for (uint32_t at = 0; at < n.length;)
+        {
+            int size = n.length - at >= 8 ? 8 : n.length - at >= 4 ? 4 : n.length - at >= 2 ? 2 : 1;
+            uint64_t value = 0;
+            uint64_t letters = 0;
+            for (int i = 0; i < size; i++)
+            {
+                unsigned char c = literal[at + i];
+                value |= static_cast<uint64_t>(c) << (8 * i);
+                if (fold && c >= 'a' && c <= 'z')
+                    letters |= uint64_t(0x20) << (8 * i);
+            }
+            a.load(A::rax, A::r12, A::r14, at, size);
+            if (size == 8)
+            {
+                if (letters != 0)
+                {
+                    a.mov(A::rcx, letters);
+                    a.orq(A::rax, A::rcx);
+                }
+                a.mov(A::rcx, value);
+                a.cmp(A::rax, A::rcx);
+            }
+            else
+            {
+                if (letters != 0)
+                    a.or32(A::rax, static_cast<uint32_t>(letters));
+                a.cmp32(A::rax, static_cast<uint32_t>(value));
+            }
+            a.jump(A::NotEqual, fail);
+            at += size;
+        }
+    }
+
+    // Loads edx with the byte a repetition repeats: the last of its string
+    // operand, which currentChar has just moved past.
+    void repeatedByte(uint32_t node, bool fold)
+    {
+        const Tree::Node &n = tree.nodes[node];
+        unsigned char c = (fold ? tree.folded : tree.pool)[n.value + n.length - 1];
+        if (fold && c >= 'a' && c <= 'z')
+            a.load(A::rdx, A::r12, A::r14, -1, 1);
+        else
+            a.mov(A::rdx, static_cast<uint64_t>(c));
+    }
+
+    // Items from tree.memoFrom on are looked up in the failure memo before
+    // they are tried, as Tree::evaluateMemoized() does.
+    bool sequence(uint32_t node, bool &fold, int fail)
+    {
+        uint32_t tried = 0;
+        for (uint32_t c = node + 1; c < tree.nodes[node].end; c = tree.nodes[c].end)
+        {
+            if (c >= tree.memoFrom)
+            {
+                a.mov(A::rdi, A::r15);
+                a.mov(A::rsi, A::r14);
+                a.mov(A::rdx, static_cast<uint64_t>(c));
+                a.mov(A::rcx, static_cast<uint64_t>(tree.nodes.size()));
+                a.call(reinterpret_cast<const void *>(&jitKnownToFail));
+                a.test(A::rax, A::rax);
+                a.jump(A::NotEqual, fail);
+                tried++;
+            }
+            if (!compile(c, fold, fail))
+                return false;
+        }
+        if (tried != 0)
+        {
+            a.mov(A::rdi, A::r15);
+            a.mov(A::rsi, static_cast<uint64_t>(tried));
+            a.call(reinterpret_cast<const void *>(&jitMatched));
+        }
+        return true;
+    }
+
+    bool compile(uint32_t node, bool &fold, int fail)
+    {
+        const Tree::Node &n = tree.nodes[node];
+        switch (n.kind)
+        {
+        case Tree::Kind::String:
+        case Tree::Kind::Wildcard:
+            check(node, fold, fail);
+            a.add(A::r14, width(n));
+            return true;
+        case Tree::Kind::Many:
+        {
+            const Tree::Node &operand = tree.nodes[node + 1];
+            if (n.end != node + 2 || !isLeaf(operand))
+                return false;
+            check(node + 1, fold, fail);
+            if (operand.kind == Tree::Kind::Wildcard)
+            {
+                a.mov(A::r14, A::r13);
+                return true;
+            }
+            a.add(A::r14, operand.length);
+            repeatedByte(node + 1, fold);
+            a.mov(A::rdi, A::r15);
+            a.mov(A::rsi, A::r14);
+            a.call(reinterpret_cast<const void *>(&jitRun));
+            a.test(A::rax, A::rax);
+            a.jump(A::Equal, fail);
+            a.add(A::r14, A::rax);
+            return true;
+        }
+        case Tree::Kind::Counter:
+        {
+            // The walker takes .{0} one byte back, which nobody writes on
+            // purpose; it keeps those.
+            const Tree::Node &operand = tree.nodes[node + 1];
+            if (n.end != node + 2 || !isLeaf(operand) || n.value > INT32_MAX ||
+                (n.value == 0 && operand.kind == Tree::Kind::Wildcard))
+                return false;
+            check(node + 1, fold, fail);
+            if (operand.kind == Tree::Kind::Wildcard)
+            {
+                a.lea(A::rax, A::r14, static_cast<int32_t>(n.value));
+                a.cmp(A::rax, A::r13);
+                a.jump(A::Above, fail);
+                a.mov(A::r14, A::rax);
+                return true;
+            }
+            a.add(A::r14, operand.length);
+            a.mov(A::rax, A::r13);
+            a.sub(A::rax, A::r14);
+            a.cmp(A::rax, n.value);
+            a.jump(A::Below, fail);
+            repeatedByte(node + 1, fold);
+            a.lea(A::rdi, A::r12, A::r14, 0);
+            a.mov(A::rsi, static_cast<uint64_t>(n.value));
+            a.call(reinterpret_cast<const void *>(&jitRunLength));
+            a.cmp(A::rax, n.value);
+            a.jump(A::NotEqual, fail);
+            a.add(A::r14, n.value);
+            return true;
+        }
+        case Tree::Kind::Or:
+        {
+            // Both branches are tried from currentChar and the further end
+            // kept in r8, which stays 0 if neither matches.
+            uint32_t lhs = node + 1;
+            uint32_t rhs = tree.nodes[lhs].end;
+            if (!isLeaf(tree.nodes[lhs]) || rhs >= n.end || !isLeaf(tree.nodes[rhs]) || tree.nodes[rhs].end != n.end)
+                return false;
+            int lhsFailed = a.label();
+            int rhsFailed = a.label();
+            a.zero(A::r8);
+            check(lhs, fold, lhsFailed);
+            a.lea(A::r8, A::r14, static_cast<int32_t>(width(tree.nodes[lhs])));
+            a.bind(lhsFailed);
+            check(rhs, fold, rhsFailed);
+            a.lea(A::rax, A::r14, static_cast<int32_t>(width(tree.nodes[rhs])));
+            a.cmp(A::r8, A::rax);
+            a.cmovb(A::r8, A::rax);
+            a.bind(rhsFailed);
+            a.test(A::r8, A::r8);
+            a.jump(A::Equal, fail);
+            a.mov(A::r14, A::r8);
+            return true;
+        }
+        case Tree::Kind::Group:
+            // Without \O{n} no group is recorded.
+            return sequence(node, fold, fail);
+        case Tree::Kind::Ignore:
+        {
+            fold = true;
+            bool compiled = sequence(node, fold, fail);
+            fold = false;
+            return compiled;
+        }
+        default:
+            return false;
+        }
+    }
+
+public:
+    explicit JitCompiler(const Tree &tree) : tree(tree)
+    {
+    }
+
+    // The function's code, or nothing if the tree has a node it can't lower.
+    std::vector<uint8_t> compile()
+    {
+        if (tree.nodes.empty() || tree.nodes[0].kind != Tree::Kind::Root)
+            return {};
+
+        // rbx, rbp and r12 to r15 are the caller's; the extra 8 bytes keep
+        // the stack 16-byte aligned for the calls.
+        for (auto r : {A::rbx, A::rbp, A::r12, A::r13, A::r14, A::r15})
+            a.push(r);
+        a.sub(A::rsp, 8);
+        a.mov(A::r15, A::rdi);
+        a.mov(A::r12, A::rsi);
+        a.mov(A::r13, A::rdx);
+        a.mov(A::rbx, A::rcx);
+        a.mov(A::rbp, A::r8);
+
+        int attempt = a.label();
+        int failed = a.label();
+        int none = a.label();
+        int done = a.label();
+        a.bind(attempt);
+        a.mov(A::r14, A::rbx);
+        bool fold = false;
+        if (!sequence(0, fold, failed))
+            return {};
+        a.mov(A::rax, A::rbx);
+        a.mov(A::rdx, A::r14);
+        a.jump(done);
+
+        a.bind(failed);
+        if (tree.memoFrom < tree.nodes.size())
+        {
+            a.mov(A::rdi, A::r15);
+            a.mov(A::rsi, static_cast<uint64_t>(tree.nodes.size()));
+            a.call(reinterpret_cast<const void *>(&jitFailed));
+        }
+        a.cmp(A::rbx, A::rbp);
+        a.jump(A::AboveOrEqual, none);
+        a.inc(A::rbx);
+        a.jump(attempt);
+
+        a.bind(none);
+        a.mov(A::rax, UINT64_MAX);
+        a.zero(A::rdx);
+
+        a.bind(done);
+        a.add(A::rsp, 8);
+        for (auto r : {A::r15, A::r14, A::r13, A::r12, A::rbp, A::rbx})
+            a.pop(r);
+        a.ret();
+        if (!a.link())
+            return {};
+        return std::move(a.code);
+    }
+};
+#endif
+
+// A pattern's tree compiled to native code, for patterns the tree walker
+// searches often enough to be worth it. Only x86-64 is targeted; elsewhere
+// compile() gives nothing and the walker carries on. The code is written
+// while its pages are writable and only then made executable, so they are
+// never both.
+class JitCode
+{
+private:
+    using Entry = JitMatch (*)(MatchContext *ctx, const char *text, size_t size, size_t first, size_t last);
+
+    void *memory = nullptr;
+    size_t capacity = 0;
+    Entry entry = nullptr;
+    size_t nodes = 0;
+
+    JitCode() = default;
+
+public:
+    JitCode(const JitCode &) = delete;
+    JitCode &operator=(const JitCode &) = delete;
+
+    ~JitCode()
+    {
+        if (memory != nullptr)
+            munmap(memory, capacity);
+    }
+
+    // Null for trees with \O{n} or in a shape the parser never gives, and
+    // when the system won't map executable memory.
+    static std::unique_ptr<JitCode> compile(const Tree &tree)
+    {
+#if defined(__x86_64__)
+        auto code = JitCompiler(tree).compile();
+        // Past this the literals are long enough that memcmp() keeps up.
+        if (code.empty() || code.size() > (1 << 20))
+            return nullptr;
+        void *memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return nullptr;
+        std::memcpy(memory, code.data(), code.size());
+        if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(memory, code.size());
+            return nullptr;
+        }
+        std::unique_ptr<JitCode> jit(new JitCode());
+        jit->memory = memory;
+        jit->capacity = code.size();
+        jit->entry = reinterpret_cast<Entry>(memory);
+        jit->nodes = tree.nodes.size();
+        return jit;
+#else
+        (void)tree;
+        return nullptr;
+#endif
+    }
+
+    // Like Tree::evaluate() on ctx.text from first, but trying no start
+    // after last, so first == last is Tree::evaluateAnchored().
+    bool match(MatchContext &ctx, size_t first, size_t last) const
+    {
+        // A start notes at most one item per node as tried.
+        ctx.trail.reserve(nodes);
+        JitMatch m = entry(&ctx, ctx.text.data(), ctx.text.size(), first, last);
+        if (m.start == SIZE_MAX)
+            return false;
+        ctx.matchStart = ctx.startingChar = m.start;
+        ctx.currentChar = m.end;
+        return true;
+    }
+};
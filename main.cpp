@@ -1,84 +1,945 @@
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
 #include "tokens.hpp"
 #include "giggaTree.hpp"
+#include "pattern.hpp"
+#include "stream.hpp"
+#include "mappedScan.hpp"
+#include "patternSet.hpp"
+#include "patternFile.hpp"
+#include "output.hpp"
+#include "fileSearch.hpp"
+#include "workStealingPool.hpp"
+#include "follow.hpp"
+#include "server.hpp"
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
-void print(ASTNode *root)
+// Shows the tree one node per line, each followed by what the walker did
+// with it when stats are given.
+void print(const Tree &tree, uint32_t node, const MatchStats *stats = nullptr, std::ostream &out = std::cout)
 {
     static int i = 0;
-    root->print();
+    tree.print(node, out);
+#if defined(PATTERN_PROFILE)
+    if (stats != nullptr && node < stats->nodes.size())
+    {
+        const NodeProfile &p = stats->nodes[node];
+        out << "\t[calls " << p.calls << ", matched " << p.matches << ", failed " << p.calls - p.matches
+            << ", bytes " << p.bytes << ", rewinds " << p.rewinds << ", memo " << p.memoHits << ", "
+            << std::chrono::duration_cast<std::chrono::microseconds>(p.time).count() << " us]";
+    }
+#endif
     i++;
-    for (auto &n : root->children)
+    for (uint32_t n = node + 1; n < tree.nodes[node].end; n = tree.nodes[n].end)
     {
-        std::cout << "\n";
+        out << "\n";
         for (int q = 0; q < i; q++)
         {
-            std::cout << "\t";
+            out << "\t";
         }
-        print(n.get());
+        print(tree, n, stats, out);
     }
     i--;
 }
 
-void printColor(const std::string &s)
+#if defined(PATTERN_PROFILE)
+// The same as print() with stats, as nested JSON objects.
+void printJson(const Tree &tree, uint32_t node, const MatchStats &stats, std::ostream &out)
 {
-    static int i = 0;
-    std::cout << (i++ % 2 == 0 ? "\033[1;47;32m" : "\033[1;47;34m") << s << "\033[0m";
+    std::ostringstream label;
+    tree.print(node, label);
+    out << "{\"node\": \"";
+    for (unsigned char c : label.str())
+    {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (c < 0x20)
+            out << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 15];
+        else
+            out << c;
+    }
+    const NodeProfile &p = stats.nodes[node];
+    out << "\", \"calls\": " << p.calls << ", \"matched\": " << p.matches << ", \"failed\": " << p.calls - p.matches
+        << ", \"bytes\": " << p.bytes << ", \"rewinds\": " << p.rewinds << ", \"memoHits\": " << p.memoHits
+        << ", \"nanoseconds\": " << p.time.count() << ", \"children\": [";
+    for (uint32_t n = node + 1; n < tree.nodes[node].end; n = tree.nodes[n].end)
+    {
+        if (n != node + 1)
+            out << ", ";
+        printJson(tree, n, stats, out);
+    }
+    out << "]}";
 }
+#endif
 
-int main(int argc, char** argv)
+enum struct OutputMode
 {
-    if(argc== 1) {
-        std::cerr << "No arguments\n";
-        return EXIT_FAILURE;
+    Lines,
+    Count,
+    Offsets,
+    OnlyMatching,
+    Quiet
+};
+
+// Writes what the output mode asks for about matches. Matched text is only
+// highlighted when stdout is a terminal.
+struct Reporter
+{
+    Output &out;
+    OutputMode mode;
+    bool color;
+    bool showNames;
+    int highlighted = 0;
+
+    void name(std::string_view name)
+    {
+        if (showNames)
+        {
+            out.write(name);
+            out.put(':');
+        }
     }
-    std::string input = argv[1];
 
-    if(!std::getline(std::cin, text))
+    void highlight(std::string_view s)
+    {
+        if (!color)
+        {
+            out.write(s);
+            return;
+        }
+        out.write(highlighted++ % 2 == 0 ? "\033[1;47;32m" : "\033[1;47;34m");
+        out.write(s);
+        out.write("\033[0m");
+    }
+
+    // A record holding matches at spans, relative to the record, which sits
+    // at offset in its input.
+    void record(std::string_view name, std::string_view record, uint64_t offset, const std::vector<Span> &spans)
+    {
+        switch (mode)
+        {
+        case OutputMode::Offsets:
+            for (auto &span : spans)
+            {
+                this->name(name);
+                out.number(offset + span.start);
+                out.put('-');
+                out.number(offset + span.end);
+                out.put('\n');
+            }
+            break;
+        case OutputMode::OnlyMatching:
+            for (auto &span : spans)
+            {
+                this->name(name);
+                highlight(record.substr(span.start, span.end - span.start));
+                out.put('\n');
+            }
+            break;
+        default:
+        {
+            this->name(name);
+            size_t i = 0;
+            for (auto &span : spans)
+            {
+                out.write(record.substr(i, span.start - i));
+                highlight(record.substr(span.start, span.end - span.start));
+                i = span.end;
+            }
+            out.write(record.substr(i));
+            out.put('\n');
+        }
+        }
+    }
+
+    // A match of pattern id in a set, as id:start-end:text in the default
+    // mode.
+    void setMatch(std::string_view name, size_t id, uint64_t start, uint64_t end, std::string_view text)
+    {
+        this->name(name);
+        out.number(id);
+        out.put(':');
+        if (mode != OutputMode::OnlyMatching)
+        {
+            out.number(start);
+            out.put('-');
+            out.number(end);
+            if (mode == OutputMode::Offsets)
+            {
+                out.put('\n');
+                return;
+            }
+            out.put(':');
+        }
+        highlight(text);
+        out.put('\n');
+    }
+
+    void count(std::string_view name, uint64_t count)
+    {
+        this->name(name);
+        out.number(count);
+        out.put('\n');
+    }
+
+    // Records the tree walker gave up on may hold matches that were never
+    // reported, so running out of budget is never silent.
+    void budget(const MatchStats &stats)
+    {
+        if (stats.budgetHits != 0)
+        {
+            std::cerr << stats.budgetHits << " of " << stats.searches << " searches ran out of budget\n";
+        }
+#if defined(PATTERN_PROFILE)
+        if (profiled != nullptr)
+            profile(stats);
+#endif
+    }
+
+#if defined(PATTERN_PROFILE)
+    // Set to the tree of the one pattern being matched to report on it.
+    const Tree *profiled = nullptr;
+    bool profileTree = false;
+    std::string profileJson = "";
+
+    void profile(const MatchStats &stats)
+    {
+        if (profileTree)
+        {
+            print(*profiled, 0, &stats, std::cerr);
+            std::cerr << "\n";
+        }
+        if (!profileJson.empty())
+        {
+            std::ofstream json(profileJson);
+            printJson(*profiled, 0, stats, json);
+            json << "\n";
+            if (!json)
+                std::cerr << "Could not write " << profileJson << "\n";
+        }
+    }
+#endif
+
+    // Counts and quiet runs say nothing more when there was no match.
+    void noMatch()
+    {
+        if (mode != OutputMode::Count && mode != OutputMode::Quiet)
+        {
+            std::cerr << "No match\n";
+        }
+    }
+};
+
+int matchStream(const Pattern &pattern, const std::vector<std::string> &paths, InputBackend input, Reporter &report)
+{
+    MatchContext ctx(pattern);
+    StreamScanner scanner(pattern, ctx, input);
+    bool matched = false;
+    bool failed = false;
+
+    auto scan = [&](int fd, const std::string &name)
+    {
+        bool ok;
+        if (report.mode == OutputMode::Count || report.mode == OutputMode::Quiet)
+        {
+            uint64_t count = scanner.count(fd, ok, report.mode == OutputMode::Quiet);
+            if (report.mode == OutputMode::Count)
+                report.count(name, count);
+            matched |= count != 0;
+        }
+        else
+        {
+            matched |= scanner.scan(fd, [&](std::string_view record, uint64_t offset, const std::vector<Span> &spans)
+                                    { report.record(name, record, offset, spans); },
+                                    ok);
+        }
+        if (!ok)
+        {
+            std::cerr << "Could not read " << name << "\n";
+            failed = true;
+        }
+    };
+
+    if (paths.empty())
+    {
+        scan(STDIN_FILENO, "(standard input)");
+    }
+    for (auto &path : paths)
+    {
+        if (matched && report.mode == OutputMode::Quiet)
+            break;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << "Could not open " << path << "\n";
+            failed = true;
+            continue;
+        }
+        scan(fd, path);
+        close(fd);
+    }
+
+    report.budget(ctx.stats);
+    if (!matched)
+    {
+        report.noMatch();
+    }
+    return matched && !failed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int matchMapped(const Pattern &pattern, const std::vector<std::string> &paths, unsigned threads, Reporter &report)
+{
+    bool matched = false;
+    bool failed = false;
+    MatchStats stats;
+
+    if (paths.empty())
     {
         std::cerr << "No input file\n";
         return EXIT_FAILURE;
     }
-    
+    for (auto &path : paths)
+    {
+        if (matched && report.mode == OutputMode::Quiet)
+            break;
+        MappedFile file(path);
+        if (!file.isOpen())
+        {
+            std::cerr << "Could not open " << path << "\n";
+            failed = true;
+            continue;
+        }
+        auto data = file.view();
+        if (report.mode == OutputMode::Quiet)
+        {
+            MatchContext ctx(pattern);
+            size_t start;
+            matched = pattern.findStart(ctx, data, 0, start);
+            stats += ctx.stats;
+            continue;
+        }
+        if (report.mode == OutputMode::Count)
+        {
+            uint64_t count = countParallel(pattern, data, threads, &stats);
+            report.count(path, count);
+            matched |= count != 0;
+            continue;
+        }
+        auto result = scanParallel(pattern, data, threads);
+        std::vector<Span> spans;
+        for (auto &record : result.records)
+        {
+            spans.assign(result.spans.begin() + record.firstSpan,
+                         result.spans.begin() + record.firstSpan + record.spanCount);
+            report.record(path, data.substr(record.offset, record.length), record.offset, spans);
+        }
+        matched |= !result.records.empty();
+        stats += result.stats;
+    }
 
-    auto tokens = Tokenizer(input).getTokens();
+    report.budget(stats);
+    if (!matched)
+    {
+        report.noMatch();
+    }
+    return matched && !failed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    /* for (auto t : tokens)
+// Searches every file under paths, "." when there are none, on a
+// work-stealing pool. Each worker keeps its context, read buffer and output
+// from task to task, and writes a task's output to memory. Whichever worker
+// finishes the oldest unwritten task writes it and every finished task after
+// it, so the output is what a single thread would have written.
+int matchRecursive(const Pattern &pattern, const std::vector<std::string> &paths, unsigned threads, Reporter &report)
+{
+    bool failed = false;
+    auto cannotRead = [&](const std::string &path)
     {
-        std::cout << "[" << t << "]\t";
+        std::cerr << "Could not read " << path << "\n";
+        failed = true;
+    };
+    auto roots = paths.empty() ? std::vector<std::string>{"."} : paths;
+    auto files = listFiles(roots, cannotRead);
+    auto tasks = planTasks(files, 8 << 20, cannotRead);
+    report.showNames = roots.size() > 1 || files.size() != 1 || files.front().path != roots.front();
+
+    struct Worker
+    {
+        MatchContext ctx;
+        std::vector<char> buffer;
+        std::vector<Span> spans;
+        std::string text;
+        Output out;
+        Reporter report;
+
+        Worker(const Pattern &pattern, const Reporter &shared)
+            : ctx(pattern), out(text), report{out, shared.mode, shared.color, shared.showNames}
+        {
+        }
+    };
+    struct Result
+    {
+        std::string text;
+        uint64_t records = 0;
+        bool failed = false;
+        bool done = false;
+    };
+
+    WorkStealingPool pool(tasks.size(), threads);
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (unsigned i = 0; i < pool.size(); i++)
+        workers.push_back(std::make_unique<Worker>(pattern, report));
+    std::vector<Result> results(tasks.size());
+    std::mutex writing;
+    size_t written = 0;
+    uint64_t fileRecords = 0;
+    bool fileFailed = false;
+    bool matched = false;
+    std::atomic<bool> stop{false};
+    bool counts = report.mode == OutputMode::Count || report.mode == OutputMode::Quiet;
+
+    auto write = [&](size_t i)
+    {
+        auto &task = tasks[i];
+        auto &file = files[task.file];
+        auto &result = results[i];
+        if (result.failed && !fileFailed)
+            cannotRead(file.path);
+        fileFailed |= result.failed;
+        fileRecords += result.records;
+        report.out.write(result.text);
+        std::string().swap(result.text);
+        if (task.last)
+        {
+            if (report.mode == OutputMode::Count && !fileFailed)
+                report.count(file.path, fileRecords);
+            matched |= fileRecords != 0;
+            fileRecords = 0;
+            fileFailed = false;
+            file.mapped.reset();
+        }
+    };
+
+    pool.run([&](unsigned w, size_t i)
+             {
+                 auto &worker = *workers[w];
+                 auto &task = tasks[i];
+                 auto &file = files[task.file];
+                 auto &result = results[i];
+                 // Once a quiet run has matched, the rest only need marking done.
+                 std::string_view text;
+                 if (!stop.load(std::memory_order_relaxed))
+                 {
+                     if (file.mapped != nullptr)
+                         text = file.mapped->view().substr(task.begin, task.end - task.begin);
+                     else if (!readFile(file.path, file.size, worker.buffer, text))
+                         result.failed = true;
+                 }
+                 if (counts)
+                 {
+                     result.records = countRecords(pattern, worker.ctx, text,
+                                                   report.mode == OutputMode::Quiet ? 1 : std::string::npos);
+                     if (result.records != 0 && report.mode == OutputMode::Quiet)
+                         stop = true;
+                 }
+                 else
+                 {
+                     auto onRecord = [&](std::string_view record, uint64_t offset, const std::vector<Span> &spans)
+                     {
+                         result.records++;
+                         worker.report.record(file.path, record, offset, spans);
+                     };
+                     scanRecords(pattern, worker.ctx, text, task.begin, worker.spans, onRecord);
+                     worker.out.flush();
+                     result.text = std::move(worker.text);
+                     worker.text.clear();
+                 }
+
+                 std::lock_guard<std::mutex> guard(writing);
+                 result.done = true;
+                 for (; written < tasks.size() && results[written].done; written++)
+                     write(written); });
+
+    MatchStats stats;
+    for (auto &worker : workers)
+        stats += worker->ctx.stats;
+    report.budget(stats);
+    if (!matched)
+    {
+        report.noMatch();
     }
-    std::cout << "\n"; */
-    
+    return matched && !failed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    auto p = Parser(tokens);
-    
-    auto root = p.parse();
-    if (!root)
+// Reports records as they are appended to paths, until interrupted or, in
+// quiet mode, until one matches. Output goes out after every change.
+int matchFollow(const Pattern &pattern, const std::vector<std::string> &paths, Reporter &report)
+{
+    if (paths.empty())
+    {
+        std::cerr << "No input file\n";
+        return EXIT_FAILURE;
+    }
+    if (report.mode == OutputMode::Count)
     {
-        std::cerr << "Could not parse tree\n";
+        std::cerr << "--follow can't be combined with --count\n";
         return EXIT_FAILURE;
     }
-    print(root.get());
-    std::cout << "\n";
 
-    auto success = root->evaluate();
+    MatchContext ctx(pattern);
+    std::vector<Span> spans;
+    FileFollower follower(paths);
+    bool matched = false;
+    report.showNames = paths.size() > 1;
+    follower.run([&](size_t file, std::string_view records, uint64_t offset)
+                 {
+                     if (report.mode == OutputMode::Quiet)
+                     {
+                         matched |= countRecords(pattern, ctx, records, 1) != 0;
+                         return !matched;
+                     }
+                     auto onRecord = [&](std::string_view record, uint64_t at, const std::vector<Span> &s)
+                     { report.record(follower.path(file), record, at, s); };
+                     matched |= scanRecords(pattern, ctx, records, offset, spans, onRecord);
+                     return true; },
+                 [&]
+                 { report.out.flush(); });
+
+    report.budget(ctx.stats);
+    return matched ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// One pattern per line of rulesPath, identified by its line number.
+bool readRules(const std::string &rulesPath, Pattern::Engine engine, std::vector<std::unique_ptr<Pattern>> &patterns,
+               std::vector<size_t> &ids)
+{
+    std::ifstream rules(rulesPath);
+    if (!rules)
+    {
+        std::cerr << "Could not open " << rulesPath << "\n";
+        return false;
+    }
+
+    std::string line;
+    for (size_t id = 1; std::getline(rules, line); id++)
+    {
+        if (line.empty())
+            continue;
+        PatternError error;
+        auto pattern = Pattern::compile(line, engine, &error);
+        if (!pattern)
+        {
+            std::cerr << "Could not parse pattern " << id << " at offset " << error.offset << ": " << error.message << "\n";
+            continue;
+        }
+        patterns.push_back(std::move(pattern));
+        ids.push_back(id);
+    }
+    return true;
+}
+
+// Every input is read once. Counts are of matches, not of lines.
+int matchSet(const PatternSet &set, const std::vector<size_t> &ids, const std::vector<std::string> &paths,
+             InputBackend input, Reporter &report)
+{
+    auto ctx = set.makeContext();
+    InputReader reader(input);
+    bool matched = false;
+    bool failed = false;
+
+    auto scan = [&](int fd, const std::string &name)
+    {
+        uint64_t count = 0;
+        bool ok = reader.read(fd, [&](std::string_view records, uint64_t offset)
+                              {
+                                  matched |= set.scan(ctx, records, offset, [&](const PatternMatch &m)
+                                                      {
+                                                          count++;
+                                                          if (report.mode != OutputMode::Count && report.mode != OutputMode::Quiet)
+                                                              report.setMatch(name, ids[m.pattern], m.start, m.end,
+                                                                              records.substr(m.start - offset, m.end - m.start)); });
+                                  return !matched || report.mode != OutputMode::Quiet; });
+        if (report.mode == OutputMode::Count)
+            report.count(name, count);
+        if (!ok)
+        {
+            std::cerr << "Could not read " << name << "\n";
+            failed = true;
+        }
+    };
+
+    if (paths.empty())
+    {
+        scan(STDIN_FILENO, "(standard input)");
+    }
+    for (auto &path : paths)
+    {
+        if (matched && report.mode == OutputMode::Quiet)
+            break;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << "Could not open " << path << "\n";
+            failed = true;
+            continue;
+        }
+        scan(fd, path);
+        close(fd);
+    }
 
-    if (!success)
+    report.budget(ctx.stats());
+    if (!matched)
     {
-        std::cerr << "No match\n";
+        report.noMatch();
+    }
+    return matched && !failed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char** argv)
+{
+    auto engine = Pattern::Engine::Automaton;
+    bool stream = false;
+    bool mapped = false;
+    bool recursive = false;
+    bool follow = false;
+    std::string servePath;
+    size_t cacheSize = 256;
+    size_t cacheMemory = 256;
+    auto input = InputBackend::Auto;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string rulesPath;
+    std::string compilePath;
+    std::string loadPath;
+    auto mode = OutputMode::Lines;
+    MatchBudget budget;
+    uint32_t jitAfter = 64;
+#if defined(PATTERN_PROFILE)
+    bool profileTree = false;
+    std::string profileJson;
+#endif
+    int arg = 1;
+    for (; arg < argc && std::string(argv[arg]).rfind("--", 0) == 0; arg++)
+    {
+        std::string option = argv[arg];
+        if (option.rfind("--engine=", 0) == 0)
+        {
+            std::string name = option.substr(9);
+            if (name != "tree" && name != "dfa")
+            {
+                std::cerr << "Unknown engine " << name << "\n";
+                return EXIT_FAILURE;
+            }
+            engine = name == "tree" ? Pattern::Engine::Tree : Pattern::Engine::Automaton;
+        }
+        else if (option == "--stream")
+        {
+            stream = true;
+        }
+        else if (option == "--mmap")
+        {
+            mapped = true;
+        }
+        else if (option == "--recursive")
+        {
+            recursive = true;
+        }
+        else if (option == "--follow")
+        {
+            follow = true;
+        }
+        else if (option.rfind("--serve=", 0) == 0)
+        {
+            servePath = option.substr(8);
+        }
+        else if (option.rfind("--cache=", 0) == 0)
+        {
+            cacheSize = std::strtoull(option.c_str() + 8, nullptr, 10);
+        }
+        else if (option.rfind("--cache-memory=", 0) == 0)
+        {
+            // In MiB, across every cached pattern and its contexts.
+            cacheMemory = std::strtoull(option.c_str() + 15, nullptr, 10);
+        }
+        else if (option.rfind("--io=", 0) == 0)
+        {
+            std::string name = option.substr(5);
+            if (name == "auto")
+                input = InputBackend::Auto;
+            else if (name == "uring")
+                input = InputBackend::Uring;
+            else if (name == "threads")
+                input = InputBackend::Threads;
+            else if (name == "read")
+                input = InputBackend::Read;
+            else
+            {
+                std::cerr << "Unknown input backend " << name << "\n";
+                return EXIT_FAILURE;
+            }
+        }
+        else if (option.rfind("--threads=", 0) == 0)
+        {
+            threads = std::max(1, std::atoi(option.c_str() + 10));
+        }
+        else if (option.rfind("--patterns=", 0) == 0)
+        {
+            rulesPath = option.substr(11);
+        }
+        else if (option.rfind("--compile=", 0) == 0)
+        {
+            compilePath = option.substr(10);
+        }
+        else if (option.rfind("--load=", 0) == 0)
+        {
+            loadPath = option.substr(7);
+        }
+        else if (option == "--count")
+        {
+            mode = OutputMode::Count;
+        }
+        else if (option == "--offsets")
+        {
+            mode = OutputMode::Offsets;
+        }
+        else if (option == "--only-matching")
+        {
+            mode = OutputMode::OnlyMatching;
+        }
+        else if (option == "--quiet")
+        {
+            mode = OutputMode::Quiet;
+        }
+        else if (option.rfind("--max-steps=", 0) == 0)
+        {
+            budget.steps = std::strtoull(option.c_str() + 12, nullptr, 10);
+        }
+        else if (option.rfind("--max-time=", 0) == 0)
+        {
+            budget.time = std::chrono::milliseconds(std::strtoull(option.c_str() + 11, nullptr, 10));
+        }
+        else if (option.rfind("--jit=", 0) == 0)
+        {
+            // How often the tree walker searches with a pattern before it is
+            // compiled to native code. off keeps every pattern interpreted,
+            // which is what the compiled code is checked against.
+            std::string value = option.substr(6);
+            jitAfter = value == "off" ? Pattern::noJit
+                                      : static_cast<uint32_t>(std::min<uint64_t>(std::strtoull(value.c_str(), nullptr, 10),
+                                                                                 Pattern::noJit - 1));
+        }
+        else if (option == "--profile" || option.rfind("--profile-json=", 0) == 0)
+        {
+#if defined(PATTERN_PROFILE)
+            if (option == "--profile")
+                profileTree = true;
+            else
+                profileJson = option.substr(15);
+#else
+            std::cerr << option << " needs a build with PATTERN_PROFILE defined, such as make match-profile\n";
+            return EXIT_FAILURE;
+#endif
+        }
+        else
+        {
+            std::cerr << "Unknown option " << option << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Patterns come with each request, compiled under the budget given here.
+    if (!servePath.empty())
+    {
+        Server server(cacheSize, cacheMemory << 20, budget, jitAfter, threads);
+        if (!server.listen(servePath))
+        {
+            std::cerr << "Could not listen on " << servePath << "\n";
+            return EXIT_FAILURE;
+        }
+        server.run();
+        return EXIT_SUCCESS;
+    }
+
+    Output out;
+    Reporter report{out, mode, isatty(STDOUT_FILENO) != 0, false};
+    if ((recursive || follow) && !rulesPath.empty())
+    {
+        std::cerr << (recursive ? "--recursive" : "--follow") << " needs a single pattern\n";
         return EXIT_FAILURE;
     }
+#if defined(PATTERN_PROFILE)
+    // Only the tree walker visits nodes, and only one tree is reported on.
+    if (profileTree || !profileJson.empty())
+    {
+        if (engine != Pattern::Engine::Tree)
+        {
+            std::cerr << "Profiling needs --engine=tree\n";
+            return EXIT_FAILURE;
+        }
+        if (!rulesPath.empty())
+        {
+            std::cerr << "Profiling needs a single pattern\n";
+            return EXIT_FAILURE;
+        }
+        report.profileTree = profileTree;
+        report.profileJson = profileJson;
+    }
+#endif
 
-    int i = 0;
+    // A compiled file holds either one pattern, stored with id 0, or a set.
+    std::unique_ptr<Pattern> pattern;
+    if (!loadPath.empty())
+    {
+        std::vector<std::unique_ptr<Pattern>> patterns;
+        std::vector<size_t> ids;
+        std::unique_ptr<AhoCorasick> literals;
+        if (!PatternFile::read(loadPath, engine, patterns, ids, literals))
+        {
+            std::cerr << "Could not load " << loadPath << "\n";
+            return EXIT_FAILURE;
+        }
+        if (patterns.size() != 1 || ids.front() != 0)
+        {
+            if (recursive || follow)
+            {
+                std::cerr << (recursive ? "--recursive" : "--follow") << " needs a single pattern\n";
+                return EXIT_FAILURE;
+            }
+#if defined(PATTERN_PROFILE)
+            if (profileTree || !profileJson.empty())
+            {
+                std::cerr << "Profiling needs a single pattern\n";
+                return EXIT_FAILURE;
+            }
+#endif
+            for (auto &p : patterns)
+            {
+                p->budget = budget;
+                p->jitAfter = jitAfter;
+            }
+            PatternSet set(std::move(patterns), std::move(literals));
+            report.showNames = argc - arg > 1;
+            return matchSet(set, ids, std::vector<std::string>(argv + arg, argv + argc), input, report);
+        }
+        pattern = std::move(patterns.front());
+    }
+    else if (!rulesPath.empty())
+    {
+        std::vector<std::unique_ptr<Pattern>> patterns;
+        std::vector<size_t> ids;
+        if (!readRules(rulesPath, engine, patterns, ids))
+            return EXIT_FAILURE;
+        for (auto &p : patterns)
+        {
+            p->budget = budget;
+            p->jitAfter = jitAfter;
+        }
+        PatternSet set(std::move(patterns));
+        if (!compilePath.empty())
+        {
+            std::vector<const Pattern *> compiled;
+            for (size_t i = 0; i < set.size(); i++)
+                compiled.push_back(&set.get(i));
+            if (!PatternFile::write(compilePath, compiled, ids, set.getLiterals()))
+            {
+                std::cerr << "Could not write " << compilePath << "\n";
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+        report.showNames = argc - arg > 1;
+        return matchSet(set, ids, std::vector<std::string>(argv + arg, argv + argc), input, report);
+    }
+    else
+    {
+        if (argc == arg)
+        {
+            std::cerr << "No arguments\n";
+            return EXIT_FAILURE;
+        }
+        PatternError error;
+        pattern = Pattern::compile(argv[arg++], engine, &error);
+        if (!pattern)
+        {
+            std::cerr << "Could not parse tree at offset " << error.offset << ": " << error.message << "\n";
+            return EXIT_FAILURE;
+        }
+        if (!compilePath.empty())
+        {
+            if (!PatternFile::write(compilePath, {pattern.get()}, {0}, nullptr))
+            {
+                std::cerr << "Could not write " << compilePath << "\n";
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+    }
+
+    pattern->budget = budget;
+    pattern->jitAfter = jitAfter;
+#if defined(PATTERN_PROFILE)
+    if (profileTree || !profileJson.empty())
+        report.profiled = &pattern->tree;
+#endif
+    if (follow)
+    {
+        return matchFollow(*pattern, std::vector<std::string>(argv + arg, argv + argc), report);
+    }
+    if (recursive)
+    {
+        return matchRecursive(*pattern, std::vector<std::string>(argv + arg, argv + argc), threads, report);
+    }
+    if (stream || mapped)
+    {
+        auto paths = std::vector<std::string>(argv + arg, argv + argc);
+        report.showNames = paths.size() > 1;
+        if (mapped)
+            return matchMapped(*pattern, paths, threads, report);
+        return matchStream(*pattern, paths, input, report);
+    }
+
+    std::string text;
+    if(!std::getline(std::cin, text))
+    {
+        std::cerr << "No input file\n";
+        return EXIT_FAILURE;
+    }
 
-    while (success)
+    // The tree is only shown to a person at a terminal, never to a pipe.
+    if (report.color && mode == OutputMode::Lines)
     {
-        std::cout << std::string(text.begin() + i, text.begin() + startingChar);
-        printColor(std::string(text.begin() + startingChar, text.begin() + currentChar));
-        i = startingChar = currentChar;
-        success = root->evaluate();
+        print(pattern->tree, 0);
+        std::cout << "\n";
+        std::cout.flush();
     }
 
-    std::cout << std::string(text.begin() + i, text.end()) << "\n";
+    MatchContext ctx(*pattern);
+    MatchIterator matches(*pattern, ctx, text);
+    std::vector<Span> spans;
+    while (matches.next())
+    {
+        spans.push_back(matches.span());
+        if (mode == OutputMode::Quiet || mode == OutputMode::Count)
+            break;
+    }
 
+    report.budget(ctx.stats);
+    if (mode == OutputMode::Count)
+    {
+        report.count("", spans.size());
+    }
+    else if (!spans.empty() && mode != OutputMode::Quiet)
+    {
+        report.record("", text, 0, spans);
+    }
+    if (spans.empty())
+    {
+        report.noMatch();
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <numeric>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pattern.hpp"
+#include "stream.hpp"
+
+class MappedFile
+{
+private:
+    void *data = MAP_FAILED;
+    size_t length = 0;
+    bool opened = false;
+
+public:
+    MappedFile(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+        {
+            length = st.st_size;
+            opened = true;
+            if (length > 0)
+            {
+                data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED)
+                    opened = false;
+                else
+                    madvise(data, length, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (data != MAP_FAILED)
+            munmap(data, length);
+    }
+
+    bool isOpen() const
+    {
+        return opened;
+    }
+
+    std::string_view view() const
+    {
+        if (data == MAP_FAILED)
+            return {};
+        return std::string_view(static_cast<const char *>(data), length);
+    }
+};
+
+struct RecordMatch
+{
+    uint64_t offset;
+    size_t length;
+    size_t firstSpan;
+    size_t spanCount;
+};
+
+// Matched records in offset order, with their spans flattened into one array.
+struct ScanResult
+{
+    std::vector<RecordMatch> records;
+    std::vector<Span> spans;
+    MatchStats stats;
+};
+
+// Splits data into up to threads ranges of whole records, returned as their
+// boundaries. The split points are moved forward to the next '\n'; since no
+// match crosses a record boundary, every match lies in exactly one range.
+std::vector<size_t> splitRecords(std::string_view data, unsigned threads)
+{
+    const size_t minRange = 1 << 16;
+    threads = std::max(1u, std::min<unsigned>(threads, data.size() / minRange + 1));
+
+    std::vector<size_t> bounds = {0};
+    for (unsigned i = 1; i < threads; i++)
+    {
+        size_t split = std::max(bounds.back(), data.size() / threads * i);
+        auto nl = data.find(recordSeparator, split);
+        if (nl == std::string::npos)
+            break;
+        if (nl + 1 > bounds.back())
+            bounds.push_back(nl + 1);
+    }
+    bounds.push_back(data.size());
+    return bounds;
+}
+
+// Calls work(range) for every range of bounds, each on its own thread.
+template <typename Work>
+void runRanges(const std::vector<size_t> &bounds, Work work)
+{
+    std::vector<std::thread> workers;
+    for (size_t range = 1; range + 1 < bounds.size(); range++)
+        workers.emplace_back(work, range);
+    work(0);
+    for (auto &w : workers)
+        w.join();
+}
+
+// Scans data on up to threads workers, each with its own MatchContext.
+// Nothing is lost or reported twice across ranges, and concatenating them
+// keeps offset order.
+ScanResult scanParallel(const Pattern &pattern, std::string_view data, unsigned threads)
+{
+    auto bounds = splitRecords(data, threads);
+    std::vector<ScanResult> results(bounds.size() - 1);
+    auto work = [&](size_t range)
+    {
+        MatchContext ctx(pattern);
+        std::vector<Span> spans;
+        auto &result = results[range];
+        auto onRecord = [&](std::string_view record, uint64_t offset, const std::vector<Span> &s)
+        {
+            result.records.push_back({offset, record.size(), result.spans.size(), s.size()});
+            result.spans.insert(result.spans.end(), s.begin(), s.end());
+        };
+        auto records = data.substr(bounds[range], bounds[range + 1] - bounds[range]);
+        scanRecords(pattern, ctx, records, bounds[range], spans, onRecord);
+        result.stats = ctx.stats;
+    };
+
+    runRanges(bounds, work);
+
+    ScanResult merged = std::move(results.front());
+    for (size_t range = 1; range < results.size(); range++)
+    {
+        size_t base = merged.spans.size();
+        for (auto record : results[range].records)
+        {
+            record.firstSpan += base;
+            merged.records.push_back(record);
+        }
+        merged.spans.insert(merged.spans.end(), results[range].spans.begin(), results[range].spans.end());
+        merged.stats += results[range].stats;
+    }
+    return merged;
+}
+
+// Number of records in data holding a match, counted on up to threads
+// workers. The workers' stats are added to stats when it is given.
+uint64_t countParallel(const Pattern &pattern, std::string_view data, unsigned threads, MatchStats *stats = nullptr)
+{
+    auto bounds = splitRecords(data, threads);
+    std::vector<uint64_t> counts(bounds.size() - 1);
+    std::vector<MatchStats> workerStats(bounds.size() - 1);
+    runRanges(bounds, [&](size_t range)
+              {
+                  MatchContext ctx(pattern);
+                  counts[range] = countRecords(pattern, ctx, data.substr(bounds[range], bounds[range + 1] - bounds[range]));
+                  workerStats[range] = ctx.stats; });
+    if (stats != nullptr)
+    {
+        for (auto &s : workerStats)
+            *stats += s;
+    }
+    return std::accumulate(counts.begin(), counts.end(), uint64_t(0));
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Buffered output straight to a file descriptor, without iostreams. Small
+// writes are gathered in one large buffer; a write too big to fit is not
+// copied but goes out together with the buffered bytes in one writev().
+// Output made over a string appends to it instead, for output produced
+// ahead of the order it is written in.
+class Output
+{
+private:
+    int fd;
+    std::vector<char> buffer;
+    size_t used = 0;
+    bool failed = false;
+    std::string *sink = nullptr;
+
+    void writeAll(iovec *parts, int count)
+    {
+        if (sink != nullptr)
+        {
+            for (int i = 0; i < count; i++)
+                sink->append(static_cast<const char *>(parts[i].iov_base), parts[i].iov_len);
+            return;
+        }
+        while (count > 0 && !failed)
+        {
+            ssize_t n = ::writev(fd, parts, count);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                failed = true;
+                return;
+            }
+            while (count > 0 && static_cast<size_t>(n) >= parts->iov_len)
+            {
+                n -= parts->iov_len;
+                parts++;
+                count--;
+            }
+            if (count > 0)
+            {
+                parts->iov_base = static_cast<char *>(parts->iov_base) + n;
+                parts->iov_len -= n;
+            }
+        }
+    }
+
+public:
+    static const size_t defaultCapacity = 1 << 18;
+
+    Output(int fd = STDOUT_FILENO, size_t capacity = defaultCapacity) : fd(fd), buffer(capacity)
+    {
+    }
+
+    Output(std::string &sink, size_t capacity = 1 << 12) : fd(-1), buffer(capacity), sink(&sink)
+    {
+    }
+
+    ~Output()
+    {
+        flush();
+    }
+
+    void write(std::string_view s)
+    {
+        if (s.size() > buffer.size() - used)
+        {
+            if (s.size() >= buffer.size())
+            {
+                iovec parts[2] = {{buffer.data(), used}, {const_cast<char *>(s.data()), s.size()}};
+                writeAll(parts, 2);
+                used = 0;
+                return;
+            }
+            flush();
+        }
+        std::memcpy(buffer.data() + used, s.data(), s.size());
+        used += s.size();
+    }
+
+    void put(char c)
+    {
+        if (used == buffer.size())
+            flush();
+        buffer[used++] = c;
+    }
+
+    void number(uint64_t n)
+    {
+        char digits[20];
+        auto result = std::to_chars(digits, digits + sizeof(digits), n);
+        write(std::string_view(digits, result.ptr - digits));
+    }
+
+    // Returns false if any write so far has failed.
+    bool flush()
+    {
+        iovec part = {buffer.data(), used};
+        writeAll(&part, 1);
+        used = 0;
+        return !failed;
+    }
+};
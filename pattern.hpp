@@ -0,0 +1,557 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include "tokens.hpp"
+#include "giggaTree.hpp"
+#include "jit.hpp"
+#include "automaton.hpp"
+#include "prefilter.hpp"
+
+struct Span
+{
+    size_t start;
+    size_t end;
+};
+
+// Caller-owned columns Pattern::findAll() stores match offsets in, both
+// capacity long.
+struct MatchBatch
+{
+    uint64_t *starts;
+    uint64_t *ends;
+    size_t capacity;
+};
+
+enum struct MatchResult
+{
+    Match,
+    NoMatch,
+    OutOfBudget
+};
+
+// A parsed and compiled pattern. Immutable once built, but for the native
+// code compiled once on first demand, so one instance can be shared by any
+// number of threads, each matching through its own MatchContext.
+struct Pattern
+{
+    enum struct Engine
+    {
+        Automaton,
+        Tree
+    };
+
+    std::string source;
+    Tree tree;
+    Nfa nfa;
+    // nfa read right to left, to find where the automaton's matches start.
+    Nfa reversed;
+    int groupCount = 0;
+    bool hasGroupSelector = false;
+    std::unique_ptr<Prefilter> prefilter;
+    // A literal every match contains somewhere, set when it is rarer than
+    // the leading one. Records without it are never matched.
+    std::unique_ptr<Prefilter> required;
+    // Always Tree for a pattern the automaton can't match exactly or would
+    // be too large for, whose nfa is then empty.
+    Engine engine = Engine::Automaton;
+    // Given to every MatchContext made for the pattern. The automaton runs
+    // in linear time and needs none, only the tree walker is held to it.
+    MatchBudget budget;
+    // Searches the tree walker makes through one context before the pattern
+    // is compiled to native code, so patterns seldom used are never
+    // compiled. noJit keeps it interpreted.
+    static constexpr uint32_t noJit = UINT32_MAX;
+    uint32_t jitAfter = 64;
+
+    // The literal every match starting at node starts with, or "".
+    // ignoreCase is set when it sits under \I.
+    static std::string_view leadingLiteral(const Tree &tree, uint32_t node, bool &ignoreCase)
+    {
+        switch (tree.nodes[node].kind)
+        {
+        case Tree::Kind::String:
+            return tree.literal(node);
+        case Tree::Kind::Ignore:
+            ignoreCase = true;
+            [[fallthrough]];
+        case Tree::Kind::Many:
+        case Tree::Kind::Counter:
+        case Tree::Kind::Group:
+        case Tree::Kind::GroupSelector:
+        case Tree::Kind::Root:
+            if (tree.nodes[node].end > node + 1)
+                return leadingLiteral(tree, node + 1, ignoreCase);
+            return "";
+        default:
+            return "";
+        }
+    }
+
+    struct Literal
+    {
+        std::string value;
+        bool ignoreCase;
+    };
+
+    // Adds the literals every match of node contains to literals, folded
+    // under \I. A repetition contains its operand followed by the copies of
+    // its last byte, and + whatever its two operands have in common.
+    static void requiredLiterals(const Tree &tree, uint32_t node, bool ignoreCase, std::vector<Literal> &literals)
+    {
+        const auto &n = tree.nodes[node];
+        auto literal = [&](uint32_t string)
+        { return ignoreCase ? foldCase(tree.literal(string)) : std::string(tree.literal(string)); };
+        switch (n.kind)
+        {
+        case Tree::Kind::String:
+            literals.push_back({literal(node), ignoreCase});
+            break;
+        case Tree::Kind::Many:
+        case Tree::Kind::Counter:
+            if (tree.nodes[node + 1].kind == Tree::Kind::String)
+            {
+                auto operand = literal(node + 1);
+                size_t copies = n.kind == Tree::Kind::Many ? 1 : std::min<size_t>(n.value, 64);
+                literals.push_back({operand + std::string(copies, operand.back()), ignoreCase});
+            }
+            break;
+        case Tree::Kind::Or:
+        {
+            uint32_t rhs = tree.nodes[node + 1].end;
+            if (tree.nodes[node + 1].kind != Tree::Kind::String || tree.nodes[rhs].kind != Tree::Kind::String)
+                break;
+            auto lhs = literal(node + 1);
+            auto common = longestCommon(lhs, literal(rhs));
+            if (!common.empty())
+                literals.push_back({std::string(common), ignoreCase});
+            break;
+        }
+        case Tree::Kind::Ignore:
+            ignoreCase = true;
+            [[fallthrough]];
+        case Tree::Kind::Group:
+        case Tree::Kind::GroupSelector:
+        case Tree::Kind::Root:
+            for (uint32_t c = node + 1; c < n.end; c = tree.nodes[c].end)
+                requiredLiterals(tree, c, ignoreCase, literals);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Longest substring of a that b contains too.
+    static std::string_view longestCommon(std::string_view a, std::string_view b)
+    {
+        std::string_view best;
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            for (size_t j = 0; j < b.size(); j++)
+            {
+                size_t k = 0;
+                while (i + k < a.size() && j + k < b.size() && a[i + k] == b[j + k])
+                    k++;
+                if (k > best.size())
+                    best = a.substr(i, k);
+            }
+        }
+        return best;
+    }
+
+    // The rarest literal every match contains, if it is worth a scan of its
+    // own: at least two bytes long and rarer than the leading literal.
+    static std::unique_ptr<Prefilter> requiredFilter(const Tree &tree, const Prefilter *leading)
+    {
+        std::vector<Literal> literals;
+        requiredLiterals(tree, 0, false, literals);
+        const Literal *best = nullptr;
+        for (auto &l : literals)
+        {
+            if (l.value.size() < 2)
+                continue;
+            if (best == nullptr || Prefilter::commonness(l.value) < Prefilter::commonness(best->value) ||
+                (Prefilter::commonness(l.value) == Prefilter::commonness(best->value) && l.value.size() > best->value.size()))
+                best = &l;
+        }
+        if (best == nullptr ||
+            (leading != nullptr && Prefilter::commonness(best->value) >= Prefilter::commonness(leading->getLiteral())))
+            return nullptr;
+        return std::make_unique<Prefilter>(best->value, best->ignoreCase);
+    }
+
+    // Returns nullptr for a malformed pattern and, if error is given, says
+    // why there.
+    static std::unique_ptr<Pattern> compile(const std::string &source, Engine engine = Engine::Automaton,
+                                            PatternError *error = nullptr)
+    {
+        Tokenizer tokenizer(source);
+        if (!tokenizer.ok())
+        {
+            if (error != nullptr)
+                *error = tokenizer.getError();
+            return nullptr;
+        }
+        auto parser = Parser(tokenizer.takeTokens());
+        if (!parser.parse())
+        {
+            if (error != nullptr)
+                *error = parser.getError();
+            return nullptr;
+        }
+
+        auto pattern = std::make_unique<Pattern>();
+        pattern->source = source;
+        pattern->tree = std::move(parser.getTree());
+        pattern->nfa.start = pattern->tree.compile(pattern->nfa);
+        pattern->groupCount = parser.getGroupCount();
+        pattern->hasGroupSelector = parser.getHasGroupSelector();
+        pattern->engine = engine;
+        if (pattern->nfa.start < 0)
+        {
+            // Only the walker matches it as the walker does, or the
+            // automaton would be too large.
+            pattern->nfa.states.clear();
+            pattern->engine = Engine::Tree;
+        }
+        pattern->reversed = pattern->nfa.reversed();
+        bool ignoreCase = false;
+        auto literal = leadingLiteral(pattern->tree, 0, ignoreCase);
+        if (!literal.empty())
+            pattern->prefilter = std::make_unique<Prefilter>(std::string(literal), ignoreCase);
+        pattern->required = requiredFilter(pattern->tree, pattern->prefilter.get());
+        return pattern;
+    }
+
+    // Finds the next match in text at or after from. text may hold several
+    // '\n'-separated records; a match never spans two. The reported span is
+    // the selected group for \O{n} patterns. Records the walker runs out of
+    // budget on are skipped, and counted in ctx.stats.
+    bool find(MatchContext &ctx, std::string_view text, size_t from, size_t &start, size_t &end) const
+    {
+        return findSkipping(ctx, text, from, start, end, true);
+    }
+
+    // Like find(), but stops at a record the walker runs out of budget on:
+    // then [start, end) is what was left of the record to search, and
+    // searching may go on after it.
+    MatchResult search(MatchContext &ctx, std::string_view text, size_t from, size_t &start, size_t &end) const
+    {
+        return search(ctx, text, from, start, end, true);
+    }
+
+    // Like find(), but only reports where the match starts. The automaton is
+    // spared the walk that resolves \O{n}, so for those patterns start is
+    // that of the whole match, in the same record.
+    bool findStart(MatchContext &ctx, std::string_view text, size_t from, size_t &start) const
+    {
+        size_t end;
+        return findSkipping(ctx, text, from, start, end, false);
+    }
+
+    // Matches only at offset at. Same reporting as find().
+    bool matchAt(MatchContext &ctx, std::string_view text, size_t at, size_t &start, size_t &end) const
+    {
+        if (engine == Engine::Tree)
+        {
+            ctx.text = text.substr(0, std::min(text.find(recordSeparator, at), text.size()));
+            ctx.startSearch();
+            ctx.currentChar = at;
+            const JitCode *code = hotCode(ctx);
+            if (!(code != nullptr ? code->match(ctx, at, at) : tree.evaluateAnchored(ctx)))
+            {
+                return false;
+            }
+            start = ctx.startingChar;
+            end = ctx.currentChar;
+            return true;
+        }
+
+        end = ctx.automaton.matchAt(text, at);
+        if (end == std::string::npos)
+        {
+            return false;
+        }
+        start = at;
+        selectGroup(ctx, text, start, end);
+        return true;
+    }
+
+    // Stores up to batch.capacity successive matches at or after from, as
+    // find() reports them, and returns how many. from is left where the next
+    // call carries on.
+    size_t findAll(MatchContext &ctx, std::string_view text, size_t &from, const MatchBatch &batch) const
+    {
+        size_t count = 0;
+        size_t start, end;
+        while (count < batch.capacity && from <= text.size() && find(ctx, text, from, start, end))
+        {
+            batch.starts[count] = start;
+            batch.ends[count] = end;
+            count++;
+            from = std::max(end, start + 1);
+        }
+        if (count < batch.capacity)
+        {
+            from = text.size() + 1;
+        }
+        return count;
+    }
+
+    // Fills ctx.indexes with every group of the match find() just reported
+    // at start. Walks made only to match record just the groups \O{n}
+    // selects, so unless that is all of them the match is walked again, from
+    // where it began rather than from the selected start.
+    void findGroups(MatchContext &ctx, std::string_view text, size_t start) const
+    {
+        if (groupCount == 0 || !tree.elidesGroups)
+        {
+            return;
+        }
+        if (hasGroupSelector)
+        {
+            start = ctx.matchStart;
+        }
+        ctx.text = text.substr(0, std::min(text.find(recordSeparator, start), text.size()));
+        ctx.startSearch();
+        ctx.currentChar = start;
+        ctx.captureAll = true;
+        tree.evaluateAnchored(ctx);
+        ctx.captureAll = false;
+    }
+
+private:
+    bool findSkipping(MatchContext &ctx, std::string_view text, size_t from, size_t &start, size_t &end,
+                      bool select) const
+    {
+        MatchResult result;
+        while ((result = search(ctx, text, from, start, end, select)) == MatchResult::OutOfBudget)
+        {
+            from = end + 1;
+        }
+        return result == MatchResult::Match;
+    }
+
+    // Start of the record holding at, but no earlier than from.
+    static size_t recordStart(std::string_view text, size_t from, size_t at)
+    {
+        auto separator = static_cast<const char *>(memrchr(text.data() + from, recordSeparator, at - from));
+        return separator == nullptr ? from : separator - text.data() + 1;
+    }
+
+    // With a required literal, the engines only see the records it occurs
+    // in, one at a time and starting no earlier than from. A literal found
+    // in most records saves less than the calls cost, so once it has let
+    // the engines see more than a fifth of the text they get it whole, and
+    // the literal is tried again every megabyte.
+    MatchResult search(MatchContext &ctx, std::string_view text, size_t from, size_t &start, size_t &end,
+                       bool select) const
+    {
+        while (from <= text.size())
+        {
+            size_t limit = text.size();
+            if (required != nullptr && ctx.requiredPays())
+            {
+                size_t hit = required->find(text, from);
+                if (hit == std::string::npos)
+                {
+                    return MatchResult::NoMatch;
+                }
+                size_t record = recordStart(text, from, hit);
+                limit = std::min(text.find(recordSeparator, hit), text.size());
+                ctx.requiredSkipped += record - from;
+                ctx.requiredSearched += limit - record + 1;
+                from = record;
+            }
+            auto records = text.substr(0, limit);
+            MatchResult result = engine == Engine::Tree ? walkRecords(ctx, records, from, start, end)
+                                                        : runAutomaton(ctx, records, from, start, end, select);
+            if (result != MatchResult::NoMatch || limit == text.size())
+            {
+                if (required != nullptr && limit == text.size())
+                {
+                    ctx.requiredBypassed += (result == MatchResult::NoMatch ? text.size() : end) - from;
+                }
+                return result;
+            }
+            from = limit + 1;
+        }
+        return MatchResult::NoMatch;
+    }
+
+    MatchResult walkRecords(MatchContext &ctx, std::string_view text, size_t from, size_t &start, size_t &end) const
+    {
+        const JitCode *code = hotCode(ctx);
+        // The walker sees one record at a time as its whole text.
+        while (from <= text.size())
+        {
+            size_t recordEnd = std::min(text.find(recordSeparator, from), text.size());
+            ctx.text = text.substr(0, recordEnd);
+            ctx.startSearch();
+            if (prefilter != nullptr)
+            {
+                // Only candidates the prefilter finds need the walker.
+                for (size_t at = from; (at = prefilter->find(ctx.text, at)) != std::string::npos; at++)
+                {
+                    ctx.currentChar = at;
+                    if (code != nullptr ? code->match(ctx, at, at) : tree.evaluateAnchored(ctx))
+                    {
+                        start = ctx.startingChar;
+                        end = ctx.currentChar;
+                        return MatchResult::Match;
+                    }
+                    if (ctx.outOfBudget)
+                    {
+                        break;
+                    }
+                }
+            }
+            else if (from < recordEnd)
+            {
+                ctx.currentChar = ctx.startingChar = from;
+                if (code != nullptr ? code->match(ctx, from, recordEnd - 1) : tree.evaluate(ctx))
+                {
+                    start = ctx.startingChar;
+                    end = ctx.currentChar;
+                    return MatchResult::Match;
+                }
+            }
+            if (ctx.outOfBudget)
+            {
+                start = from;
+                end = recordEnd;
+                return MatchResult::OutOfBudget;
+            }
+            from = recordEnd + 1;
+        }
+        return MatchResult::NoMatch;
+    }
+
+    MatchResult runAutomaton(MatchContext &ctx, std::string_view text, size_t from, size_t &start, size_t &end,
+                             bool select) const
+    {
+        if (!ctx.automaton.find(text, from, start, end))
+        {
+            return MatchResult::NoMatch;
+        }
+        if (select)
+        {
+            selectGroup(ctx, text, start, end);
+        }
+        return MatchResult::Match;
+    }
+
+    void selectGroup(MatchContext &ctx, std::string_view text, size_t &start, size_t &end) const
+    {
+        if (!hasGroupSelector)
+        {
+            return;
+        }
+        // The automaton only knows the overall span, the tree walker
+        // recovers the selected group in one pass from the known start. It
+        // agrees with the automaton on where the match ends, so it never
+        // needs to look further and the record's end isn't searched for.
+        ctx.text = text.substr(0, end);
+        ctx.startSearch();
+        ctx.currentChar = start;
+        if (tree.evaluateAnchored(ctx))
+        {
+            start = ctx.startingChar;
+            end = ctx.currentChar;
+        }
+    }
+
+    // The native code the walker's searches through ctx run, once ctx has
+    // searched jitAfter times. Null before, and for good where the pattern
+    // can't be compiled or a budget needs the walker to count its steps.
+    const JitCode *hotCode([[maybe_unused]] MatchContext &ctx) const
+    {
+#if defined(PATTERN_PROFILE)
+        // Only the walker counts what each node does.
+        return nullptr;
+#else
+        if (ctx.jitUses <= jitAfter)
+        {
+            if (jitAfter == noJit || ctx.budget.steps != 0 || ctx.budget.time.count() != 0 ||
+                ctx.jitUses++ < jitAfter)
+            {
+                return nullptr;
+            }
+            // Compiled once, by the first context to ask.
+            std::call_once(jitOnce, [this]
+                           { jitCode = JitCode::compile(tree); });
+            ctx.jit = jitCode.get();
+        }
+        return ctx.jit;
+#endif
+    }
+
+    mutable std::once_flag jitOnce;
+    mutable std::unique_ptr<JitCode> jitCode;
+};
+
+MatchContext::MatchContext(const Pattern &pattern)
+    : indexes(pattern.groupCount + 1), automaton(pattern.nfa, pattern.reversed, pattern.prefilter.get()), budget(pattern.budget)
+{
+#if defined(PATTERN_PROFILE)
+    stats.nodes.resize(pattern.tree.nodes.size());
+#endif
+}
+
+// Steps through the matches of a pattern in text as find() reports them.
+// Matches and groups are spans into text; nothing is copied and, once the
+// context has warmed up, nothing is allocated.
+class MatchIterator
+{
+private:
+    const Pattern &pattern;
+    MatchContext &ctx;
+    std::string_view text;
+    size_t from;
+    Span current{0, 0};
+    bool hasGroups = false;
+
+public:
+    MatchIterator(const Pattern &pattern, MatchContext &ctx, std::string_view text, size_t from = 0)
+        : pattern(pattern), ctx(ctx), text(text), from(from)
+    {
+    }
+
+    // Moves to the next match. Returns false once there is none.
+    bool next()
+    {
+        if (from > text.size() || !pattern.find(ctx, text, from, current.start, current.end))
+        {
+            from = std::string::npos;
+            return false;
+        }
+        from = std::max(current.end, current.start + 1);
+        hasGroups = false;
+        return true;
+    }
+
+    Span span() const
+    {
+        return current;
+    }
+
+    // Group i of the current match, numbered from 1 by its '('. Both ends are
+    // npos for a group the pattern doesn't have.
+    Span group(int i)
+    {
+        if (i < 1 || i > pattern.groupCount)
+        {
+            return {std::string::npos, std::string::npos};
+        }
+        if (!hasGroups)
+        {
+            pattern.findGroups(ctx, text, current.start);
+            hasGroups = true;
+        }
+        return {ctx.indexes[i].start, ctx.indexes[i].end};
+    }
+};
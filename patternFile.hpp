@@ -0,0 +1,334 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "giggaTree.hpp"
+#include "pattern.hpp"
+#include "patternSet.hpp"
+#include "mappedScan.hpp"
+
+// Compiled patterns on disk, so a run can start without tokenizing or
+// parsing anything. The file is mapped and every table is copied out of
+// the mapping in one piece: the tree's node arena and literal pool, the NFA
+// states as they sit in memory, the prefilter literal and, for a pattern
+// set, the Aho-Corasick tables.
+//
+// Layout, all fields native-endian:
+//   header   magic "GIGGAPAT", version, sizeof(NfaState), pattern count,
+//            whether literal tables follow
+//   pattern  id, source, group count, has group selector, prefilter
+//            literal and case flag, tree nodes, literal pool, NFA start and
+//            states, -1 and none where only the walker can match it
+//                                                     (repeated)
+//   literals byte classes, transition table, outputs  (optional)
+// Arrays are a uint64_t element count followed by the raw elements.
+struct PatternFile
+{
+    static constexpr uint32_t version = 3;
+
+    struct Writer
+    {
+        std::string out;
+
+        template <typename T>
+        void put(const T &value)
+        {
+            out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+        }
+
+        template <typename T>
+        void putArray(const T *data, size_t count)
+        {
+            put<uint64_t>(count);
+            out.append(reinterpret_cast<const char *>(data), count * sizeof(T));
+        }
+
+        // Like putArray(), but writes copies whose padding is zeroed, so the
+        // same patterns always give the same file. copy sets the fields of
+        // one copy from the element.
+        template <typename T, typename Copy>
+        void putFields(const T *data, size_t count, Copy copy)
+        {
+            std::vector<T> copies(count);
+            std::memset(static_cast<void *>(copies.data()), 0, count * sizeof(T));
+            for (size_t i = 0; i < count; i++)
+                copy(copies[i], data[i]);
+            putArray(copies.data(), count);
+        }
+
+        void putString(std::string_view s)
+        {
+            putArray(s.data(), s.size());
+        }
+    };
+
+    struct Reader
+    {
+        std::string_view in;
+        bool ok = true;
+
+        template <typename T>
+        T get()
+        {
+            T value{};
+            if (in.size() < sizeof(T))
+            {
+                ok = false;
+                return value;
+            }
+            std::memcpy(&value, in.data(), sizeof(T));
+            in.remove_prefix(sizeof(T));
+            return value;
+        }
+
+        template <typename T>
+        std::vector<T> getArray()
+        {
+            uint64_t count = get<uint64_t>();
+            if (!ok || count > in.size() / sizeof(T))
+            {
+                ok = false;
+                return {};
+            }
+            std::vector<T> values(count);
+            std::memcpy(values.data(), in.data(), count * sizeof(T));
+            in.remove_prefix(count * sizeof(T));
+            return values;
+        }
+
+        std::string getString()
+        {
+            auto chars = getArray<char>();
+            return std::string(chars.begin(), chars.end());
+        }
+
+        // A string left where it is in the input.
+        std::string_view getView()
+        {
+            uint64_t count = get<uint64_t>();
+            if (!ok || count > in.size())
+            {
+                ok = false;
+                return {};
+            }
+            auto view = in.substr(0, count);
+            in.remove_prefix(count);
+            return view;
+        }
+    };
+
+    // Whether tree has the shape the parser gives it, so neither engine can
+    // step outside the arrays on a damaged file.
+    static bool valid(const Tree &tree, int groupCount)
+    {
+        auto &nodes = tree.nodes;
+        if (nodes.empty() || nodes[0].kind != Tree::Kind::Root || nodes[0].end != nodes.size())
+            return false;
+        for (uint32_t i = 0; i < nodes.size(); i++)
+        {
+            auto &n = nodes[i];
+            if (n.end <= i || n.end > nodes.size())
+                return false;
+            uint32_t children = 0;
+            for (uint32_t c = i + 1; c < n.end; c = nodes[c].end)
+            {
+                if (nodes[c].end <= c || nodes[c].end > n.end || nodes[c].kind == Tree::Kind::Root)
+                    return false;
+                children++;
+            }
+            switch (n.kind)
+            {
+            case Tree::Kind::String:
+                if (children != 0 || n.length == 0 || static_cast<uint64_t>(n.value) + n.length > tree.pool.size())
+                    return false;
+                break;
+            case Tree::Kind::Wildcard:
+                if (children != 0)
+                    return false;
+                break;
+            case Tree::Kind::Many:
+            case Tree::Kind::Counter:
+                if (children != 1 || (nodes[i + 1].kind != Tree::Kind::String && nodes[i + 1].kind != Tree::Kind::Wildcard))
+                    return false;
+                if (n.kind == Tree::Kind::Counter && n.value > Tree::maxCount)
+                    return false;
+                break;
+            case Tree::Kind::Or:
+                if (children != 2)
+                    return false;
+                break;
+            case Tree::Kind::Group:
+                if (n.value > static_cast<uint32_t>(groupCount))
+                    return false;
+                break;
+            case Tree::Kind::Root:
+                if (i != 0)
+                    return false;
+                break;
+            case Tree::Kind::Ignore:
+            case Tree::Kind::GroupSelector:
+                break;
+            default:
+                return false;
+            }
+        }
+        return tree.folded.size() == tree.pool.size();
+    }
+
+    // A damaged table must not send a scan out of bounds.
+    static bool valid(const AhoCorasick &ac, const std::vector<uint16_t> &byteClass,
+                      const std::vector<std::unique_ptr<Pattern>> &patterns)
+    {
+        size_t literalCount = std::count_if(patterns.begin(), patterns.end(), [](const std::unique_ptr<Pattern> &p)
+                                            { return p->prefilter != nullptr; });
+        if (byteClass.size() != ac.byteClass.size() || ac.classes == 0 || ac.table.size() % ac.classes != 0 ||
+            ac.outputStart.size() != ac.table.size() / ac.classes + 1 || ac.lengths.size() != literalCount)
+            return false;
+        size_t states = ac.table.size() / ac.classes;
+        if (std::any_of(byteClass.begin(), byteClass.end(), [&](uint16_t c)
+                        { return c >= ac.classes; }) ||
+            std::any_of(ac.table.begin(), ac.table.end(), [&](int32_t s)
+                        { return s < 0 || static_cast<size_t>(s) >= states; }) ||
+            std::any_of(ac.outputs.begin(), ac.outputs.end(), [&](uint32_t o)
+                        { return o >= literalCount; }))
+            return false;
+        for (size_t i = 0; i < states; i++)
+        {
+            if (ac.outputStart[i] > ac.outputStart[i + 1])
+                return false;
+        }
+        return ac.outputStart.front() == 0 && ac.outputStart.back() == ac.outputs.size();
+    }
+
+    // Writes patterns, tagged with ids, and optionally a set's literal tables.
+    static bool write(const std::string &path, const std::vector<const Pattern *> &patterns,
+                      const std::vector<size_t> &ids, const AhoCorasick *literals)
+    {
+        Writer w;
+        w.out.append("GIGGAPAT", 8);
+        w.put<uint32_t>(version);
+        w.put<uint32_t>(sizeof(NfaState));
+        w.put<uint32_t>(patterns.size());
+        w.put<uint32_t>(literals != nullptr);
+
+        for (size_t i = 0; i < patterns.size(); i++)
+        {
+            auto &p = *patterns[i];
+            w.put<uint64_t>(ids[i]);
+            w.putString(p.source);
+            w.put<int32_t>(p.groupCount);
+            w.put<uint8_t>(p.hasGroupSelector);
+            w.put<uint8_t>(p.prefilter != nullptr);
+            if (p.prefilter)
+            {
+                w.put<uint8_t>(p.prefilter->isIgnoreCase());
+                w.putString(p.prefilter->getLiteral());
+            }
+
+            w.putFields(p.tree.nodes.data(), p.tree.nodes.size(), [](Tree::Node &to, const Tree::Node &from)
+                        {
+                            to.kind = from.kind;
+                            to.end = from.end;
+                            to.value = from.value;
+                            to.length = from.length; });
+            w.putString(p.tree.pool);
+            w.put<int32_t>(p.nfa.start);
+            w.putFields(p.nfa.states.data(), p.nfa.states.size(), [](NfaState &to, const NfaState &from)
+                        {
+                            to.type = from.type;
+                            to.bytes = from.bytes;
+                            to.out = from.out;
+                            to.out1 = from.out1; });
+        }
+
+        if (literals != nullptr)
+        {
+            w.putArray(literals->byteClass.data(), literals->byteClass.size());
+            w.put<uint64_t>(literals->classes);
+            w.putArray(literals->table.data(), literals->table.size());
+            w.putArray(literals->outputStart.data(), literals->outputStart.size());
+            w.putArray(literals->outputs.data(), literals->outputs.size());
+            w.putArray(literals->lengths.data(), literals->lengths.size());
+        }
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(w.out.data(), w.out.size());
+        return static_cast<bool>(file);
+    }
+
+    // Loads a file written by write(). literals is left empty when the file
+    // holds none. Returns false for a missing, foreign or damaged file.
+    static bool read(const std::string &path, Pattern::Engine engine, std::vector<std::unique_ptr<Pattern>> &patterns,
+                     std::vector<size_t> &ids, std::unique_ptr<AhoCorasick> &literals)
+    {
+        MappedFile file(path);
+        if (!file.isOpen())
+            return false;
+        Reader r{file.view()};
+        if (r.in.substr(0, 8) != "GIGGAPAT")
+            return false;
+        r.in.remove_prefix(8);
+        if (r.get<uint32_t>() != version || r.get<uint32_t>() != sizeof(NfaState))
+            return false;
+        uint32_t count = r.get<uint32_t>();
+        bool hasLiterals = r.get<uint32_t>() != 0;
+
+        for (uint32_t i = 0; i < count && r.ok; i++)
+        {
+            auto p = std::make_unique<Pattern>();
+            ids.push_back(r.get<uint64_t>());
+            p->source = r.getString();
+            p->groupCount = r.get<int32_t>();
+            p->hasGroupSelector = r.get<uint8_t>() != 0;
+            p->engine = engine;
+            if (r.get<uint8_t>() != 0)
+            {
+                bool ignoreCase = r.get<uint8_t>() != 0;
+                p->prefilter = std::make_unique<Prefilter>(r.getString(), ignoreCase);
+            }
+
+            p->tree.nodes = r.getArray<Tree::Node>();
+            p->tree.pool = r.getString();
+            p->tree.folded = foldCase(p->tree.pool);
+            p->tree.analyze();
+            if (p->groupCount < 0 || !valid(p->tree, p->groupCount))
+                return false;
+            p->required = Pattern::requiredFilter(p->tree, p->prefilter.get());
+            p->nfa.start = r.get<int32_t>();
+            p->nfa.states = r.getArray<NfaState>();
+            if (p->nfa.start == -1 && p->nfa.states.empty())
+                p->engine = Pattern::Engine::Tree;
+            else if (p->nfa.start < 0 || static_cast<size_t>(p->nfa.start) >= p->nfa.states.size())
+                return false;
+            for (auto &s : p->nfa.states)
+            {
+                if (s.out >= static_cast<int>(p->nfa.states.size()) || s.out1 >= static_cast<int>(p->nfa.states.size()))
+                    return false;
+            }
+            p->reversed = p->nfa.reversed();
+            patterns.push_back(std::move(p));
+        }
+
+        if (r.ok && hasLiterals)
+        {
+            auto ac = std::unique_ptr<AhoCorasick>(new AhoCorasick());
+            auto byteClass = r.getArray<uint16_t>();
+            ac->classes = r.get<uint64_t>();
+            ac->table = r.getArray<int32_t>();
+            ac->outputStart = r.getArray<uint32_t>();
+            ac->outputs = r.getArray<uint32_t>();
+            ac->lengths = r.getArray<uint32_t>();
+            if (!r.ok || !valid(*ac, byteClass, patterns))
+                return false;
+            std::copy(byteClass.begin(), byteClass.end(), ac->byteClass.begin());
+            literals = std::move(ac);
+        }
+        return r.ok;
+    }
+};
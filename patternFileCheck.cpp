@@ -0,0 +1,82 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include "patternFile.hpp"
+
+// Writes a pattern file, damages it the ways a reader has to catch, and
+// fails unless PatternFile::read() turns each damaged copy down and still
+// loads the intact one.
+
+bool load(const std::string &path)
+{
+    std::vector<std::unique_ptr<Pattern>> patterns;
+    std::vector<size_t> ids;
+    std::unique_ptr<AhoCorasick> literals;
+    return PatternFile::read(path, Pattern::Engine::Automaton, patterns, ids, literals);
+}
+
+std::string slurp(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void spill(const std::string &path, const std::string &bytes)
+{
+    std::ofstream(path, std::ios::binary | std::ios::trunc).write(bytes.data(), bytes.size());
+}
+
+int main()
+{
+    std::string path = "/tmp/patternFileCheck." + std::to_string(getpid());
+    auto pattern = Pattern::compile("x.{3}y");
+    if (!pattern || !PatternFile::write(path, {pattern.get()}, {1}, nullptr) || !load(path))
+    {
+        std::cerr << "Could not write and read back x.{3}y\n";
+        return EXIT_FAILURE;
+    }
+
+    // Nodes are written with their padding zeroed, so the counter is found
+    // by its bytes.
+    auto &tree = pattern->tree;
+    auto counter = std::find_if(tree.nodes.begin(), tree.nodes.end(), [](const Tree::Node &n)
+                                { return n.kind == Tree::Kind::Counter; });
+    Tree::Node node;
+    std::memset(static_cast<void *>(&node), 0, sizeof(node));
+    node.kind = counter->kind;
+    node.end = counter->end;
+    node.value = counter->value;
+    node.length = counter->length;
+    std::string intact = slurp(path);
+    size_t at = intact.find(std::string(reinterpret_cast<const char *>(&node), sizeof(node)));
+    if (at == std::string::npos)
+    {
+        std::cerr << "No counter node in the file\n";
+        return EXIT_FAILURE;
+    }
+
+    bool failed = false;
+    for (uint32_t count : {Tree::maxCount + 1, 0x80000000u, 0xFFFFFFFFu})
+    {
+        std::string damaged = intact;
+        std::memcpy(&damaged[at + offsetof(Tree::Node, value)], &count, sizeof(count));
+        spill(path, damaged);
+        if (load(path))
+        {
+            std::cerr << "Loaded a counter of " << count << "\n";
+            failed = true;
+        }
+    }
+    unlink(path.c_str());
+    if (!failed)
+        std::cout << "Damaged counts rejected\n";
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
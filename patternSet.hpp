@@ -0,0 +1,258 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <queue>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include "pattern.hpp"
+#include "caseFold.hpp"
+
+// Aho-Corasick automaton over case-folded literals, stored as a dense
+// transition table over the byte classes the literals actually use. Every
+// other byte shares one class, so the table stays small for thousands of
+// literals and a scan costs two lookups per byte regardless of their count.
+class AhoCorasick
+{
+private:
+    std::array<uint16_t, 256> byteClass{};
+    size_t classes = 1;
+    std::vector<int32_t> table;
+    std::vector<uint32_t> outputStart;
+    std::vector<uint32_t> outputs;
+    std::vector<uint32_t> lengths;
+
+    friend struct PatternFile;
+    AhoCorasick() = default;
+
+public:
+    AhoCorasick(const std::vector<std::string> &literals)
+    {
+        for (auto &literal : literals)
+        {
+            for (unsigned char c : literal)
+            {
+                if (byteClass[c] == 0)
+                    byteClass[c] = classes++;
+            }
+            lengths.push_back(literal.size());
+        }
+        // Upper case text shares the class of its folded letter.
+        for (int c = 'A'; c <= 'Z'; c++)
+            byteClass[c] = byteClass[foldByte(c)];
+
+        // Trie, with -1 for a missing edge.
+        std::vector<std::vector<uint32_t>> own(1);
+        table.assign(classes, -1);
+        for (size_t i = 0; i < literals.size(); i++)
+        {
+            int32_t state = 0;
+            for (unsigned char c : literals[i])
+            {
+                auto &next = table[state * classes + byteClass[c]];
+                if (next == -1)
+                {
+                    next = own.size();
+                    own.emplace_back();
+                    table.resize(table.size() + classes, -1);
+                }
+                state = table[state * classes + byteClass[c]];
+            }
+            own[state].push_back(i);
+        }
+
+        // Breadth first: fill missing edges from the failure state and merge
+        // the outputs of every state with those of its failure state.
+        std::vector<int32_t> fail(own.size(), 0);
+        std::vector<std::vector<uint32_t>> all(own.size());
+        std::queue<int32_t> queue;
+        all[0] = own[0];
+        for (size_t c = 0; c < classes; c++)
+        {
+            auto &next = table[c];
+            if (next == -1)
+                next = 0;
+            else
+                queue.push(next);
+        }
+        while (!queue.empty())
+        {
+            int32_t state = queue.front();
+            queue.pop();
+            all[state] = own[state];
+            all[state].insert(all[state].end(), all[fail[state]].begin(), all[fail[state]].end());
+            for (size_t c = 0; c < classes; c++)
+            {
+                auto &next = table[state * classes + c];
+                int32_t fallback = table[fail[state] * classes + c];
+                if (next == -1)
+                {
+                    next = fallback;
+                }
+                else
+                {
+                    fail[next] = fallback;
+                    queue.push(next);
+                }
+            }
+        }
+
+        for (auto &o : all)
+        {
+            outputStart.push_back(outputs.size());
+            outputs.insert(outputs.end(), o.begin(), o.end());
+        }
+        outputStart.push_back(outputs.size());
+    }
+
+    // Calls onHit(literal, start) for every occurrence, in order of the
+    // position the occurrence ends at.
+    template <typename OnHit>
+    void scan(std::string_view text, OnHit onHit) const
+    {
+        int32_t state = 0;
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            state = table[state * classes + byteClass[static_cast<unsigned char>(text[i])]];
+            for (uint32_t o = outputStart[state]; o != outputStart[state + 1]; o++)
+                onHit(outputs[o], i + 1 - lengths[outputs[o]]);
+        }
+    }
+};
+
+struct PatternMatch
+{
+    size_t pattern;
+    uint64_t start;
+    uint64_t end;
+};
+
+// Many patterns compiled together and matched in one pass. Patterns with a
+// leading literal are found through a shared Aho-Corasick automaton and only
+// verified by their own matcher where their literal occurs; the rest each
+// scan the input on their own.
+class PatternSet
+{
+private:
+    std::vector<std::unique_ptr<Pattern>> patterns;
+    std::vector<size_t> literalPattern;
+    std::vector<size_t> unfiltered;
+    std::unique_ptr<AhoCorasick> literals;
+
+public:
+    // Per-thread state for matching a set: one lazily created context per
+    // pattern plus scratch space.
+    struct Context
+    {
+        std::vector<std::unique_ptr<MatchContext>> contexts;
+        std::vector<size_t> nextFrom;
+        std::vector<PatternMatch> matches;
+
+        MatchContext &get(const PatternSet &set, size_t pattern)
+        {
+            if (!contexts[pattern])
+                contexts[pattern] = std::make_unique<MatchContext>(*set.patterns[pattern]);
+            return *contexts[pattern];
+        }
+
+        MatchStats stats() const
+        {
+            MatchStats total;
+            for (auto &c : contexts)
+            {
+                if (c)
+                    total += c->stats;
+            }
+            return total;
+        }
+    };
+
+    // literals, when given, must have been built from these patterns, as
+    // when a set is loaded back from a PatternFile.
+    PatternSet(std::vector<std::unique_ptr<Pattern>> patterns, std::unique_ptr<AhoCorasick> literals = nullptr)
+        : patterns(std::move(patterns)), literals(std::move(literals))
+    {
+        std::vector<std::string> folded;
+        for (size_t i = 0; i < this->patterns.size(); i++)
+        {
+            auto &prefilter = this->patterns[i]->prefilter;
+            if (prefilter)
+            {
+                folded.push_back(foldCase(prefilter->getLiteral()));
+                literalPattern.push_back(i);
+            }
+            else
+            {
+                unfiltered.push_back(i);
+            }
+        }
+        if (!folded.empty() && !this->literals)
+            this->literals = std::make_unique<AhoCorasick>(folded);
+    }
+
+    size_t size() const
+    {
+        return patterns.size();
+    }
+
+    const Pattern &get(size_t i) const
+    {
+        return *patterns[i];
+    }
+
+    const AhoCorasick *getLiterals() const
+    {
+        return literals.get();
+    }
+
+    Context makeContext() const
+    {
+        Context ctx;
+        ctx.contexts.resize(patterns.size());
+        ctx.nextFrom.resize(patterns.size());
+        return ctx;
+    }
+
+    // Reports every pattern's matches in a run of records, ordered by offset
+    // and then pattern index, as onMatch(match). Each pattern's matches are
+    // exactly those Pattern::find() reports on its own.
+    template <typename OnMatch>
+    bool scan(Context &ctx, std::string_view records, uint64_t offset, OnMatch onMatch) const
+    {
+        ctx.matches.clear();
+        std::fill(ctx.nextFrom.begin(), ctx.nextFrom.end(), 0);
+        size_t start, end;
+
+        if (literals)
+        {
+            // Hits of one literal arrive in order of their start, so a hit
+            // inside a reported match is skipped just like find() would.
+            literals->scan(records, [&](uint32_t literal, size_t at)
+                           {
+                               size_t p = literalPattern[literal];
+                               if (at < ctx.nextFrom[p])
+                                   return;
+                               if (patterns[p]->matchAt(ctx.get(*this, p), records, at, start, end))
+                               {
+                                   ctx.matches.push_back({p, offset + start, offset + end});
+                                   ctx.nextFrom[p] = std::max(end, start + 1);
+                               } });
+        }
+        for (size_t p : unfiltered)
+        {
+            auto &pattern = *patterns[p];
+            auto &mc = ctx.get(*this, p);
+            for (size_t from = 0; pattern.find(mc, records, from, start, end); from = std::max(end, start + 1))
+                ctx.matches.push_back({p, offset + start, offset + end});
+        }
+
+        std::sort(ctx.matches.begin(), ctx.matches.end(), [](const PatternMatch &a, const PatternMatch &b)
+                  { return a.start != b.start ? a.start < b.start : a.pattern < b.pattern; });
+        for (auto &m : ctx.matches)
+            onMatch(m);
+        return !ctx.matches.empty();
+    }
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "caseFold.hpp"
+
+// Finds occurrences of a literal every match has to start with, so the
+// matcher only runs where a match can actually begin. Two of the literal's
+// rarest bytes are compared 16 or 32 positions at a time and only positions
+// where both agree are verified with memcmp. The widest implementation the
+// CPU supports is picked once, at construction.
+//
+// For \I patterns the literal is stored folded. A probe byte that is a
+// letter is compared with 0x20 or-ed into the text, which folds exactly
+// that letter, so case-insensitive scans take the same path.
+class Prefilter
+{
+private:
+    using Search = size_t (*)(const Prefilter &, const char *, size_t, size_t);
+
+    std::string literal;
+    bool ignoreCase;
+    size_t first = 0;
+    size_t second = 0;
+    unsigned char firstMask = 0;
+    unsigned char secondMask = 0;
+    Search search = nullptr;
+
+    // Rough rank of how common a byte is in text and logs, higher is more
+    // common.
+    static int frequency(unsigned char c)
+    {
+        static const char common[] = " etaoinsrhldcumfpgwybvkxjqz0123456789";
+        if (c >= 'A' && c <= 'Z')
+            return frequency(c - 'A' + 'a') / 2;
+        auto p = std::strchr(common, c);
+        if (c != 0 && p != nullptr)
+            return 255 - (p - common) * 4;
+        return c < 128 ? 32 : 8;
+    }
+
+    bool verify(const char *text, size_t at) const
+    {
+        if (ignoreCase)
+            return equalsFolded(text + at, literal.data(), literal.size());
+        return std::memcmp(text + at, literal.data(), literal.size()) == 0;
+    }
+
+    static size_t searchScalar(const Prefilter &f, const char *text, size_t n, size_t from)
+    {
+        unsigned char c = f.literal[f.first];
+        for (size_t at = from; at + f.literal.size() <= n; at++)
+        {
+            if (f.firstMask != 0)
+            {
+                if ((text[at + f.first] | f.firstMask) == c && f.verify(text, at))
+                    return at;
+                continue;
+            }
+            auto hit = static_cast<const char *>(std::memchr(text + at + f.first, c, n - f.literal.size() + 1 - at));
+            if (hit == nullptr)
+                return std::string::npos;
+            at = hit - text - f.first;
+            if (f.verify(text, at))
+                return at;
+        }
+        return std::string::npos;
+    }
+
+#if defined(__x86_64__)
+    static size_t searchSse2(const Prefilter &f, const char *text, size_t n, size_t from)
+    {
+        const __m128i a = _mm_set1_epi8(f.literal[f.first]);
+        const __m128i b = _mm_set1_epi8(f.literal[f.second]);
+        const __m128i am = _mm_set1_epi8(f.firstMask);
+        const __m128i bm = _mm_set1_epi8(f.secondMask);
+        size_t at = from;
+        for (; at + f.literal.size() + 15 <= n; at += 16)
+        {
+            __m128i x = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(text + at + f.first)), am);
+            __m128i y = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(text + at + f.second)), bm);
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, a), _mm_cmpeq_epi8(y, b)));
+            while (mask != 0)
+            {
+                size_t candidate = at + __builtin_ctz(mask);
+                if (f.verify(text, candidate))
+                    return candidate;
+                mask &= mask - 1;
+            }
+        }
+        return searchScalar(f, text, n, at);
+    }
+
+    __attribute__((target("avx2"))) static size_t searchAvx2(const Prefilter &f, const char *text, size_t n, size_t from)
+    {
+        const __m256i a = _mm256_set1_epi8(f.literal[f.first]);
+        const __m256i b = _mm256_set1_epi8(f.literal[f.second]);
+        const __m256i am = _mm256_set1_epi8(f.firstMask);
+        const __m256i bm = _mm256_set1_epi8(f.secondMask);
+        size_t at = from;
+        for (; at + f.literal.size() + 31 <= n; at += 32)
+        {
+            __m256i x = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + at + f.first)), am);
+            __m256i y = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + at + f.second)), bm);
+            unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(x, a), _mm256_cmpeq_epi8(y, b)));
+            while (mask != 0)
+            {
+                size_t candidate = at + __builtin_ctz(mask);
+                if (f.verify(text, candidate))
+                    return candidate;
+                mask &= mask - 1;
+            }
+        }
+        return searchSse2(f, text, n, at);
+    }
+#endif
+
+public:
+    Prefilter(std::string literal, bool ignoreCase = false)
+        : literal(ignoreCase ? foldCase(literal) : std::move(literal)), ignoreCase(ignoreCase)
+    {
+        // The two rarest positions; the first one is the one memchr uses.
+        for (size_t i = 1; i < this->literal.size(); i++)
+        {
+            if (frequency(this->literal[i]) < frequency(this->literal[first]))
+                first = i;
+        }
+        second = first == 0 ? this->literal.size() - 1 : 0;
+        for (size_t i = 0; i < this->literal.size(); i++)
+        {
+            if (i != first && frequency(this->literal[i]) < frequency(this->literal[second]))
+                second = i;
+        }
+
+        if (ignoreCase)
+        {
+            firstMask = isFoldable(this->literal[first]) ? 0x20 : 0;
+            secondMask = isFoldable(this->literal[second]) ? 0x20 : 0;
+        }
+
+        search = searchScalar;
+#if defined(__x86_64__)
+        if (this->literal.size() > 1)
+            search = __builtin_cpu_supports("avx2") ? searchAvx2 : searchSse2;
+#endif
+    }
+
+    // How common a literal is expected to be, lower is rarer: the
+    // frequencies of the two bytes a search would probe, as picked above.
+    static int commonness(std::string_view literal)
+    {
+        int rarest = 255;
+        int second = 255;
+        for (unsigned char c : literal)
+        {
+            int f = frequency(c);
+            if (f < rarest)
+            {
+                second = rarest;
+                rarest = f;
+            }
+            else if (f < second)
+            {
+                second = f;
+            }
+        }
+        return rarest + second;
+    }
+
+    const std::string &getLiteral() const
+    {
+        return literal;
+    }
+
+    bool isIgnoreCase() const
+    {
+        return ignoreCase;
+    }
+
+    // Offset of the next occurrence of the literal at or after from, or npos.
+    size_t find(std::string_view text, size_t from) const
+    {
+        if (from > text.size())
+            return std::string::npos;
+        return search(*this, text.data(), text.size(), from);
+    }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Length of the run of c at the start of text[0, n), found 16 or 32 bytes
+// per step with one compare and a movemask. Repetitions in the tree walker
+// spend all their time here on long runs of padding or separators.
+
+size_t runLengthScalar(const char *text, size_t n, char c)
+{
+    size_t i = 0;
+    while (i < n && text[i] == c)
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__)
+size_t runLengthSse2(const char *text, size_t n, char c)
+{
+    const __m128i run = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i)), run));
+        if (mask != 0xFFFF)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + runLengthScalar(text + i, n - i, c);
+}
+
+__attribute__((target("avx2"))) size_t runLengthAvx2(const char *text, size_t n, char c)
+{
+    const __m256i run = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        unsigned mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i)), run));
+        if (mask != 0xFFFFFFFFu)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + runLengthSse2(text + i, n - i, c);
+}
+#endif
+
+size_t runLength(const char *text, size_t n, char c)
+{
+    // Short bounds, like most {n}, and runs that end within a byte or two
+    // aren't worth going wide for.
+    if (n < 16)
+        return runLengthScalar(text, n, c);
+    if (text[0] != c || text[1] != c)
+        return text[0] != c ? 0 : 1;
+#if defined(__x86_64__)
+    static const auto impl = __builtin_cpu_supports("avx2") ? runLengthAvx2 : runLengthSse2;
+    return 2 + impl(text + 2, n - 2, c);
+#else
+    return 2 + runLengthScalar(text + 2, n - 2, c);
+#endif
+}
@@ -0,0 +1,629 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include "pattern.hpp"
+#include "patternFile.hpp"
+#include "stream.hpp"
+
+// Latencies counted into buckets an eighth of a power of two wide, so a
+// percentile is read to within 12.5% without keeping the samples.
+// Counting is a relaxed atomic add, safe from any thread.
+class LatencyHistogram
+{
+private:
+    static const int subBuckets = 8;
+    std::atomic<uint64_t> buckets[64 * subBuckets] = {};
+
+    static size_t bucket(uint64_t ns)
+    {
+        if (ns < subBuckets)
+            return ns;
+        int exponent = 63 - __builtin_clzll(ns);
+        return (exponent - 2) * subBuckets + ((ns >> (exponent - 3)) & (subBuckets - 1));
+    }
+
+    // The middle of the range of latencies counted in bucket i.
+    static uint64_t value(size_t i)
+    {
+        if (i < subBuckets)
+            return i;
+        int exponent = static_cast<int>(i / subBuckets) + 2;
+        uint64_t low = (subBuckets + i % subBuckets) << (exponent - 3);
+        return low + (uint64_t(1) << (exponent - 3)) / 2;
+    }
+
+public:
+    void add(std::chrono::nanoseconds latency)
+    {
+        buckets[bucket(std::max<int64_t>(0, latency.count()))].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const
+    {
+        uint64_t total = 0;
+        for (auto &b : buckets)
+            total += b.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    // Latency below which a fraction q of those counted fall.
+    std::chrono::nanoseconds percentile(double q) const
+    {
+        uint64_t total = count();
+        uint64_t rank = static_cast<uint64_t>(q * total + 0.5);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < 64 * subBuckets; i++)
+        {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen != 0 && seen >= rank)
+                return std::chrono::nanoseconds(value(i));
+        }
+        return std::chrono::nanoseconds(0);
+    }
+};
+
+// Compiled patterns by engine and source, the least recently used dropped
+// past capacity or once all of them take up more than maxBytes. Each gets
+// an id a client may send instead of the source while it stays cached. A
+// pattern keeps the contexts requests have used on it, so a request on a
+// cached pattern allocates nothing; their DFAs are most of what an entry
+// takes up, and are counted as they are handed back. Entries are shared,
+// so one dropped while a request uses it lives until that ends.
+class PatternCache
+{
+public:
+    struct Entry
+    {
+        uint32_t id;
+        std::string key;
+        std::unique_ptr<Pattern> pattern;
+        std::mutex lock;
+        std::vector<std::unique_ptr<MatchContext>> idle;
+        std::atomic<size_t> idleBytes{0};
+        // What the entry was last counted as in the cache's total, and
+        // whether it is still counted. Guarded by the cache's lock.
+        size_t bytes = 0;
+        bool cached = false;
+
+        std::unique_ptr<MatchContext> acquire()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (idle.empty())
+                return std::make_unique<MatchContext>(*pattern);
+            auto ctx = std::move(idle.back());
+            idle.pop_back();
+            idleBytes -= ctx->memory();
+            return ctx;
+        }
+
+        void release(std::unique_ptr<MatchContext> ctx)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            idleBytes += ctx->memory();
+            idle.push_back(std::move(ctx));
+        }
+
+        size_t memory() const
+        {
+            auto &p = *pattern;
+            return sizeof(*this) + sizeof(p) + key.size() + p.source.size() + 2 * p.tree.pool.size() +
+                   p.tree.nodes.size() * sizeof(Tree::Node) +
+                   (p.nfa.states.size() + p.reversed.states.size()) * sizeof(NfaState) + idleBytes;
+        }
+    };
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+
+private:
+    using Order = std::list<std::shared_ptr<Entry>>;
+
+    std::mutex lock;
+    size_t capacity;
+    size_t maxBytes;
+    size_t bytes = 0;
+    MatchBudget budget;
+    uint32_t jitAfter;
+    Order order;
+    std::unordered_map<std::string, Order::iterator> byKey;
+    std::unordered_map<uint32_t, Order::iterator> byId;
+    uint32_t nextId = 1;
+
+    std::shared_ptr<Entry> use(Order::iterator at)
+    {
+        order.splice(order.begin(), order, at);
+        return order.front();
+    }
+
+    // Drops the least recently used entries until the rest fit, but always
+    // keeps the one just used. Called with lock held.
+    void evict()
+    {
+        while (order.size() > 1 && (order.size() > capacity || bytes > maxBytes))
+        {
+            auto &last = *order.back();
+            bytes -= last.bytes;
+            last.cached = false;
+            byKey.erase(last.key);
+            byId.erase(last.id);
+            order.pop_back();
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    PatternCache(size_t capacity, size_t maxBytes, MatchBudget budget, uint32_t jitAfter)
+        : capacity(std::max<size_t>(1, capacity)), maxBytes(maxBytes), budget(budget), jitAfter(jitAfter)
+    {
+    }
+
+    // Parsing and compiling happen outside the lock, so a miss doesn't hold
+    // up requests on other patterns. Returns null with error set when source
+    // doesn't parse or there is no memory to compile it; nothing is cached
+    // then.
+    std::shared_ptr<Entry> get(std::string_view source, Pattern::Engine engine, PatternError &error)
+    {
+        std::string key(1, static_cast<char>(engine));
+        key.append(source);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto found = byKey.find(key);
+            if (found != byKey.end())
+            {
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return use(found->second);
+            }
+        }
+        misses.fetch_add(1, std::memory_order_relaxed);
+        auto entry = std::make_shared<Entry>();
+        try
+        {
+            entry->pattern = Pattern::compile(std::string(source), engine, &error);
+        }
+        catch (const std::bad_alloc &)
+        {
+            // One client's pattern must not take the server down.
+            error = {0, "out of memory compiling the pattern"};
+            return nullptr;
+        }
+        if (!entry->pattern)
+            return nullptr;
+        entry->pattern->budget = budget;
+        entry->pattern->jitAfter = jitAfter;
+        entry->key = std::move(key);
+
+        std::lock_guard<std::mutex> guard(lock);
+        auto found = byKey.find(entry->key);
+        if (found != byKey.end())
+            return use(found->second);
+        entry->id = nextId++;
+        entry->bytes = entry->memory();
+        entry->cached = true;
+        bytes += entry->bytes;
+        order.push_front(entry);
+        byKey[entry->key] = order.begin();
+        byId[entry->id] = order.begin();
+        evict();
+        return entry;
+    }
+
+    // Hands ctx back to entry and counts what its DFAs have grown to.
+    void release(const std::shared_ptr<Entry> &entry, std::unique_ptr<MatchContext> ctx)
+    {
+        entry->release(std::move(ctx));
+        std::lock_guard<std::mutex> guard(lock);
+        if (!entry->cached)
+            return;
+        size_t now = entry->memory();
+        bytes += now - entry->bytes;
+        entry->bytes = now;
+        evict();
+    }
+
+    // Null once the pattern has been dropped.
+    std::shared_ptr<Entry> get(uint32_t id)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto found = byId.find(id);
+        if (found == byId.end())
+        {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return use(found->second);
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return order.size();
+    }
+
+    size_t memory()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return bytes;
+    }
+};
+
+// Serves matches over a Unix domain socket. A connection sends frames and
+// gets one back for each, in order: a uint32_t length, then the body,
+// encoded as PatternFile does (native-endian, strings as a uint64_t length
+// and the bytes).
+//
+// Request  kind (uint8_t): 1 match, 2 stats
+//   match  uint32_t count, then per request: mode, engine (0 automaton,
+//          1 tree) and whether the pattern is given by id, each a uint8_t,
+//          the pattern's id (uint32_t) or source (string), input (string)
+// Response to match: uint32_t count, then per request: status, pattern id
+//          (uint32_t), then for Ok
+//            Exists  uint8_t matched
+//            First   uint8_t matched, uint64_t start, uint64_t end
+//            All     uint64_t count, then start and end of each match
+//            Count   uint64_t records holding a match
+//          and for any other status an error message (string)
+// Response to stats: requests, batches, p50, p90, p99 and max latency in
+//          nanoseconds, cache hits, misses, evictions, size and bytes
+//          taken up, each a uint64_t
+//
+// Workers share one epoll set. A connection is armed once, so only one
+// worker reads a frame from it at a time and its responses keep the order
+// of its requests. Sockets never block a read: a worker takes what has
+// arrived of a frame and goes back to the set, and the frame is picked up
+// where it was left once more arrives. Writes don't block either: what the
+// socket won't take is kept and sent as it drains, and no further frame is
+// read until it has been. So a client that stalls mid-frame, or reads its
+// responses slowly, holds up no worker. The requests of one frame run on
+// the worker that read its last byte, one after another, and each is timed
+// on its own.
+class Server
+{
+public:
+    enum struct Mode : uint8_t
+    {
+        Exists,
+        First,
+        All,
+        Count
+    };
+
+    enum struct Status : uint8_t
+    {
+        Ok,
+        BadPattern,
+        UnknownPattern,
+        BadRequest
+    };
+
+    static const uint32_t maxFrame = 1u << 28;
+
+private:
+    // A client, what it has sent so far of the frame being read, length
+    // included, and what it has yet to be sent of the last response. Only
+    // the worker its one-shot event woke touches it.
+    struct Connection
+    {
+        int fd;
+        std::string frame;
+        size_t received = 0;
+        std::string response;
+        size_t sent = 0;
+    };
+
+    PatternCache cache;
+    LatencyHistogram latency;
+    std::atomic<uint64_t> maxLatency{0};
+    std::atomic<uint64_t> batches{0};
+    int listener = -1;
+    int events = -1;
+    unsigned threads;
+
+    void match(PatternFile::Reader &in, PatternFile::Writer &out)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        auto mode = static_cast<Mode>(in.get<uint8_t>());
+        auto engine = in.get<uint8_t>() == 1 ? Pattern::Engine::Tree : Pattern::Engine::Automaton;
+        bool byId = in.get<uint8_t>() != 0;
+        uint32_t id = byId ? in.get<uint32_t>() : 0;
+        std::string_view source = byId ? std::string_view() : in.getView();
+        std::string_view text = in.getView();
+
+        PatternError error;
+        std::shared_ptr<PatternCache::Entry> entry;
+        if (in.ok)
+            entry = byId ? cache.get(id) : cache.get(source, engine, error);
+        if (!in.ok || entry == nullptr || mode > Mode::Count)
+        {
+            bool malformed = !in.ok || mode > Mode::Count;
+            out.put(static_cast<uint8_t>(malformed ? Status::BadRequest
+                                         : byId    ? Status::UnknownPattern
+                                                   : Status::BadPattern));
+            out.put<uint32_t>(id);
+            out.putString(malformed ? "malformed request"
+                          : byId    ? "no cached pattern has this id"
+                                    : error.message);
+            record(std::chrono::steady_clock::now() - begin);
+            return;
+        }
+
+        const Pattern &pattern = *entry->pattern;
+        auto ctx = entry->acquire();
+        out.put(static_cast<uint8_t>(Status::Ok));
+        out.put<uint32_t>(entry->id);
+        size_t start = 0, end = 0;
+        switch (mode)
+        {
+        case Mode::Exists:
+            out.put<uint8_t>(pattern.findStart(*ctx, text, 0, start));
+            break;
+        case Mode::First:
+        {
+            bool found = pattern.find(*ctx, text, 0, start, end);
+            out.put<uint8_t>(found);
+            out.put<uint64_t>(found ? start : 0);
+            out.put<uint64_t>(found ? end : 0);
+            break;
+        }
+        case Mode::All:
+        {
+            // The count goes in front once the matches have been written.
+            size_t countAt = out.out.size();
+            uint64_t count = 0;
+            out.put(count);
+            MatchIterator matches(pattern, *ctx, text);
+            while (matches.next())
+            {
+                out.put<uint64_t>(matches.span().start);
+                out.put<uint64_t>(matches.span().end);
+                count++;
+            }
+            std::memcpy(&out.out[countAt], &count, sizeof(count));
+            break;
+        }
+        case Mode::Count:
+            out.put<uint64_t>(countRecords(pattern, *ctx, text));
+            break;
+        }
+        cache.release(entry, std::move(ctx));
+        record(std::chrono::steady_clock::now() - begin);
+    }
+
+    void record(std::chrono::nanoseconds took)
+    {
+        latency.add(took);
+        uint64_t ns = took.count();
+        uint64_t seen = maxLatency.load(std::memory_order_relaxed);
+        while (ns > seen && !maxLatency.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void stats(PatternFile::Writer &out)
+    {
+        out.put<uint64_t>(latency.count());
+        out.put<uint64_t>(batches.load(std::memory_order_relaxed));
+        // A bucket's middle may lie past the slowest request in it.
+        uint64_t slowest = maxLatency.load(std::memory_order_relaxed);
+        for (double q : {0.5, 0.9, 0.99})
+            out.put<uint64_t>(std::min<uint64_t>(latency.percentile(q).count(), slowest));
+        out.put<uint64_t>(slowest);
+        out.put<uint64_t>(cache.hits.load(std::memory_order_relaxed));
+        out.put<uint64_t>(cache.misses.load(std::memory_order_relaxed));
+        out.put<uint64_t>(cache.evictions.load(std::memory_order_relaxed));
+        out.put<uint64_t>(cache.size());
+        out.put<uint64_t>(cache.memory());
+    }
+
+    // Reads what has arrived of conn's frame, without waiting for more, and
+    // answers the frame once it is whole. The body is read as it arrives,
+    // so a client announcing a large frame only costs what it has sent.
+    // False when the connection is done with, closed by the client or
+    // sending something unreadable.
+    bool receive(Connection &conn, PatternFile::Writer &out)
+    {
+        while (true)
+        {
+            size_t want = sizeof(uint32_t);
+            if (conn.received >= want)
+            {
+                uint32_t length;
+                std::memcpy(&length, conn.frame.data(), sizeof(length));
+                if (length == 0 || length > maxFrame)
+                    return false;
+                want += length;
+                if (conn.received == want)
+                {
+                    bool ok = serve(std::string_view(conn.frame).substr(sizeof(uint32_t), length), out);
+                    conn.frame.clear();
+                    conn.received = 0;
+                    if (!ok)
+                        return false;
+                    conn.response.swap(out.out);
+                    conn.sent = 0;
+                    return flush(conn);
+                }
+            }
+            size_t chunk = std::min<size_t>(want - conn.received, 1 << 16);
+            if (conn.frame.size() < conn.received + chunk)
+                conn.frame.resize(conn.received + chunk);
+            ssize_t n = ::read(conn.fd, &conn.frame[conn.received], chunk);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (n <= 0)
+                return false;
+            conn.received += n;
+        }
+    }
+
+    // Sends what the socket takes of conn's response, without waiting. It is
+    // cleared once all sent. False when the client is gone.
+    static bool flush(Connection &conn)
+    {
+        while (conn.sent < conn.response.size())
+        {
+            ssize_t n = ::send(conn.fd, conn.response.data() + conn.sent, conn.response.size() - conn.sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (n <= 0)
+                return false;
+            conn.sent += n;
+        }
+        conn.response.clear();
+        conn.sent = 0;
+        return true;
+    }
+
+    // Answers one whole frame into out. False when the frame is unreadable.
+    bool serve(std::string_view frame, PatternFile::Writer &out)
+    {
+        PatternFile::Reader in{frame};
+        out.out.clear();
+        out.put<uint32_t>(0);
+        uint8_t kind = in.get<uint8_t>();
+        if (kind == 1)
+        {
+            uint32_t count = in.get<uint32_t>();
+            out.put(count);
+            for (uint32_t i = 0; i < count && in.ok; i++)
+                match(in, out);
+            if (!in.ok)
+                return false;
+            batches.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if (kind == 2)
+        {
+            stats(out);
+        }
+        else
+        {
+            return false;
+        }
+        uint32_t size = static_cast<uint32_t>(out.out.size() - sizeof(uint32_t));
+        std::memcpy(&out.out[0], &size, sizeof(size));
+        return true;
+    }
+
+    // The listener is registered with a null pointer, every client with
+    // its Connection, which is freed when the client is closed. A client is
+    // armed for reading, or for writing while a response is left to send.
+    void work()
+    {
+        PatternFile::Writer out;
+        epoll_event event;
+        while (true)
+        {
+            int n = epoll_wait(events, &event, 1, -1);
+            if (n < 0 && errno != EINTR)
+                return;
+            if (n <= 0)
+                continue;
+            if (event.data.ptr == nullptr)
+            {
+                int client = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (client < 0)
+                    continue;
+                auto conn = std::make_unique<Connection>();
+                conn->fd = client;
+                epoll_event armed = {EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, {}};
+                armed.data.ptr = conn.get();
+                if (epoll_ctl(events, EPOLL_CTL_ADD, client, &armed) != 0)
+                    close(client);
+                else
+                    conn.release();
+                continue;
+            }
+            auto conn = static_cast<Connection *>(event.data.ptr);
+            bool ok = !conn->response.empty() ? (event.events & EPOLLOUT) && flush(*conn)
+                                               : (event.events & EPOLLIN) && receive(*conn, out);
+            if (!ok)
+            {
+                close(conn->fd);
+                delete conn;
+                continue;
+            }
+            // Only reads watch for a hang-up: a client that has shut down
+            // its end may still be reading its response.
+            uint32_t wanted = conn->response.empty() ? EPOLLIN | EPOLLRDHUP : EPOLLOUT;
+            epoll_event armed = {wanted | EPOLLONESHOT, {}};
+            armed.data.ptr = conn;
+            epoll_ctl(events, EPOLL_CTL_MOD, conn->fd, &armed);
+        }
+    }
+
+public:
+    Server(size_t cacheSize, size_t cacheBytes, MatchBudget budget, uint32_t jitAfter, unsigned threads)
+        : cache(cacheSize, cacheBytes, budget, jitAfter), threads(std::max(1u, threads))
+    {
+    }
+
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    ~Server()
+    {
+        if (events >= 0)
+            close(events);
+        if (listener >= 0)
+            close(listener);
+    }
+
+    // Binds to path, replacing a socket left there by an earlier run.
+    bool listen(const std::string &path)
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+            return false;
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(path.c_str());
+
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        events = epoll_create1(EPOLL_CLOEXEC);
+        if (listener < 0 || events < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            ::listen(listener, SOMAXCONN) != 0)
+            return false;
+        epoll_event accepting = {EPOLLIN | EPOLLEXCLUSIVE, {}};
+        accepting.data.ptr = nullptr;
+        return epoll_ctl(events, EPOLL_CTL_ADD, listener, &accepting) == 0;
+    }
+
+    // Serves until the process is stopped.
+    void run()
+    {
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; i++)
+            workers.emplace_back([this]
+                                 { work(); });
+        work();
+        for (auto &w : workers)
+            w.join();
+    }
+};
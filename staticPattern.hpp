@@ -0,0 +1,633 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "tokens.hpp"
+#include "giggaTree.hpp"
+#include "caseFold.hpp"
+#include "prefilter.hpp"
+#include "runLength.hpp"
+
+// Patterns fixed at build time, parsed by the compiler. C++17 can't take a
+// string literal as a template argument, so the pattern is named by a
+// constexpr array:
+//
+//     static constexpr char waterloo[] = "Waterloo.*";
+//     bool found = match<waterloo>(text);
+//
+// The grammar and node layout are those of Parser and Tree, and matching
+// follows Tree's walker step for step, but every node is its own function
+// with its literal, count and \I flag as constants. Nothing is parsed at run
+// time, and a malformed pattern fails to compile.
+
+// Tokenizer and Parser over a fixed-size arena, usable in constant
+// expressions. N is one more than the pattern length, which bounds both the
+// tokens and the nodes. String nodes refer to the pattern itself instead of
+// a pool.
+template <size_t N>
+struct StaticTree
+{
+    struct StaticToken
+    {
+        Token::Type type;
+        size_t offset;
+        size_t begin;
+        size_t length;
+    };
+
+    Tree::Node nodes[N]{};
+    uint32_t size = 0;
+    StaticToken tokens[N]{};
+    size_t tokenCount = 0;
+    size_t currentToken = 0;
+    int groupCount = 0;
+    bool ok = true;
+    size_t errorOffset = 0;
+
+    constexpr bool fail(size_t offset)
+    {
+        ok = false;
+        errorOffset = offset;
+        return false;
+    }
+
+    constexpr void addToken(Token::Type type, size_t offset, size_t begin, size_t length)
+    {
+        tokens[tokenCount++] = {type, offset, begin, length};
+    }
+
+    constexpr void addString(size_t start, size_t at)
+    {
+        if (at > start)
+            addToken(Token::Type::String, start, start, at - start);
+    }
+
+    static constexpr size_t findClose(const char *s, size_t n, size_t from)
+    {
+        while (from < n && s[from] != '}')
+            from++;
+        return from;
+    }
+
+    constexpr void tokenize(const char *s, size_t n)
+    {
+        size_t start = 0;
+        for (size_t i = 0; i < n && ok; i++)
+        {
+            Token::Type type = Token::Type::String;
+            switch (s[i])
+            {
+            case '*':
+                type = Token::Type::Many;
+                break;
+            case '.':
+                type = Token::Type::Wildcard;
+                break;
+            case '+':
+                type = Token::Type::Or;
+                break;
+            case '(':
+                type = Token::Type::OpenParan;
+                break;
+            case ')':
+                type = Token::Type::CloseParan;
+                break;
+            case '{':
+            {
+                addString(start, i);
+                size_t close = findClose(s, n, i + 1);
+                if (close == n)
+                {
+                    fail(i);
+                    return;
+                }
+                addToken(Token::Type::Counter, i, i + 1, close - i - 1);
+                i = close;
+                start = i + 1;
+                continue;
+            }
+            case '\\':
+            {
+                addString(start, i);
+                size_t escape = i++;
+                if (i < n && s[i] == 'O')
+                {
+                    i++;
+                    size_t close = findClose(s, n, i + 1);
+                    if (i >= n || s[i] != '{' || close == n)
+                    {
+                        fail(escape);
+                        return;
+                    }
+                    addToken(Token::Type::GroupSelector, escape, i + 1, close - i - 1);
+                    i = close;
+                }
+                else if (i < n && s[i] == 'I')
+                {
+                    addToken(Token::Type::Ignore, escape, 0, 0);
+                }
+                else
+                {
+                    fail(escape);
+                    return;
+                }
+                start = i + 1;
+                continue;
+            }
+            default:
+                continue;
+            }
+            addString(start, i);
+            addToken(type, i, 0, 0);
+            start = i + 1;
+        }
+        addString(start, n);
+    }
+
+    constexpr uint32_t open(Tree::Kind kind, uint32_t value = 0)
+    {
+        nodes[size] = {kind, 0, value, 0};
+        return size++;
+    }
+
+    constexpr void close(uint32_t node)
+    {
+        nodes[node].end = size;
+    }
+
+    constexpr void wrap(uint32_t first, Tree::Kind kind, uint32_t value)
+    {
+        for (uint32_t i = first; i < size; i++)
+            nodes[i].end++;
+        for (uint32_t i = size; i > first; i--)
+            nodes[i] = nodes[i - 1];
+        nodes[first] = {kind, size + 1, value, 0};
+        size++;
+    }
+
+    constexpr bool readNumber(const char *s, const StaticToken &t, uint32_t &number)
+    {
+        if (t.length == 0 || t.length > 9)
+            return fail(t.offset);
+        number = 0;
+        for (size_t i = t.begin; i < t.begin + t.length; i++)
+        {
+            if (s[i] < '0' || s[i] > '9')
+                return fail(t.offset);
+            number = number * 10 + (s[i] - '0');
+        }
+        return true;
+    }
+
+    constexpr bool isOperand(size_t token) const
+    {
+        return token < tokenCount &&
+               (tokens[token].type == Token::Type::String || tokens[token].type == Token::Type::Wildcard);
+    }
+
+    constexpr void buildOperand(const StaticToken &t)
+    {
+        if (t.type == Token::Type::Wildcard)
+        {
+            close(open(Tree::Kind::Wildcard));
+            return;
+        }
+        uint32_t node = open(Tree::Kind::String, t.begin);
+        nodes[node].length = t.length;
+        close(node);
+    }
+
+    constexpr bool buildOperation(const char *s)
+    {
+        StaticToken operand = tokens[currentToken++];
+        if (currentToken == tokenCount)
+        {
+            buildOperand(operand);
+            return true;
+        }
+        StaticToken op = tokens[currentToken];
+        uint32_t node = 0;
+        switch (op.type)
+        {
+        case Token::Type::Or:
+            if (!isOperand(++currentToken))
+                return fail(op.offset);
+            node = open(Tree::Kind::Or);
+            buildOperand(operand);
+            buildOperand(tokens[currentToken++]);
+            close(node);
+            return true;
+        case Token::Type::Many:
+            currentToken++;
+            node = open(Tree::Kind::Many);
+            buildOperand(operand);
+            close(node);
+            return true;
+        case Token::Type::Counter:
+        {
+            uint32_t count = 0;
+            if (!readNumber(s, op, count))
+                return false;
+            if (count > Tree::maxCount)
+                return fail(op.offset);
+            currentToken++;
+            node = open(Tree::Kind::Counter, count);
+            buildOperand(operand);
+            close(node);
+            return true;
+        }
+        default:
+            buildOperand(operand);
+            return true;
+        }
+    }
+
+    constexpr bool buildGroup(const char *s)
+    {
+        const StaticToken paren = tokens[currentToken++];
+        uint32_t group = open(Tree::Kind::Group, ++groupCount);
+        while (currentToken < tokenCount && tokens[currentToken].type != Token::Type::CloseParan)
+        {
+            if (!isOperand(currentToken))
+                return fail(tokens[currentToken].offset);
+            if (!buildOperation(s))
+                return false;
+        }
+        if (currentToken == tokenCount)
+            return fail(paren.offset);
+        currentToken++;
+        close(group);
+        return true;
+    }
+
+    constexpr bool parse(const char *s)
+    {
+        if (tokenCount == 0)
+            return fail(0);
+
+        uint32_t root = open(Tree::Kind::Root);
+        uint32_t selectorStart = size;
+        uint32_t ignoreStart = size;
+        int selectorGroups = groupCount;
+        while (currentToken < tokenCount)
+        {
+            const StaticToken t = tokens[currentToken];
+            switch (t.type)
+            {
+            case Token::Type::String:
+            case Token::Type::Wildcard:
+                if (!buildOperation(s))
+                    return false;
+                break;
+            case Token::Type::OpenParan:
+                if (!buildGroup(s))
+                    return false;
+                break;
+            case Token::Type::Ignore:
+                if (ignoreStart == size)
+                    return fail(t.offset);
+                wrap(ignoreStart, Tree::Kind::Ignore, 0);
+                currentToken++;
+                ignoreStart = size;
+                break;
+            case Token::Type::GroupSelector:
+            {
+                uint32_t selection = 0;
+                if (!readNumber(s, t, selection))
+                    return false;
+                if (selectorStart == size)
+                    return fail(t.offset);
+                if (selection != 0 && (selection <= static_cast<uint32_t>(selectorGroups) ||
+                                       selection > static_cast<uint32_t>(groupCount)))
+                    return fail(t.offset);
+                wrap(selectorStart, Tree::Kind::GroupSelector, selection);
+                currentToken++;
+                selectorStart = ignoreStart = size;
+                selectorGroups = groupCount;
+                break;
+            }
+            default:
+                return fail(t.offset);
+            }
+        }
+        close(root);
+        return true;
+    }
+};
+
+template <size_t N>
+constexpr StaticTree<N> parseStatic(const char *source)
+{
+    StaticTree<N> tree;
+    tree.tokenize(source, N - 1);
+    if (tree.ok)
+        tree.parse(source);
+    return tree;
+}
+
+template <const char *Source>
+class StaticPattern
+{
+private:
+    static constexpr size_t length = std::char_traits<char>::length(Source);
+    static constexpr StaticTree<length + 1> tree = parseStatic<length + 1>(Source);
+    static_assert(tree.ok, "malformed pattern");
+
+    struct Context
+    {
+        std::string_view text;
+        size_t currentChar = 0;
+        size_t startingChar = 0;
+        GroupIndexe indexes[tree.groupCount + 1];
+    };
+
+    // Nothing reads a group but the \O{n} selecting it, so no other group
+    // is recorded at all.
+    static constexpr bool isSelected(uint32_t group)
+    {
+        for (size_t i = 0; i < tree.size; i++)
+        {
+            if (tree.nodes[i].kind == Tree::Kind::GroupSelector && tree.nodes[i].value == group)
+                return true;
+        }
+        return false;
+    }
+
+    // The String node every match starts with, or 0, as
+    // Pattern::leadingLiteral() finds it.
+    static constexpr uint32_t leadingString(uint32_t node)
+    {
+        switch (tree.nodes[node].kind)
+        {
+        case Tree::Kind::String:
+            return node;
+        case Tree::Kind::Ignore:
+        case Tree::Kind::Many:
+        case Tree::Kind::Counter:
+        case Tree::Kind::Group:
+        case Tree::Kind::GroupSelector:
+        case Tree::Kind::Root:
+            return tree.nodes[node].end > node + 1 ? leadingString(node + 1) : 0;
+        default:
+            return 0;
+        }
+    }
+
+    static constexpr bool underIgnore(uint32_t node)
+    {
+        for (uint32_t i = 0; i < node; i++)
+        {
+            if (tree.nodes[i].kind == Tree::Kind::Ignore && tree.nodes[i].end > node)
+                return true;
+        }
+        return false;
+    }
+
+    static constexpr uint32_t leading = leadingString(0);
+
+    // Built on first use; a literal that fits the string's inline buffer
+    // doesn't allocate.
+    static const Prefilter &prefilter()
+    {
+        static const Prefilter filter(std::string(Source + tree.nodes[leading].value, tree.nodes[leading].length),
+                                      underIgnore(leading));
+        return filter;
+    }
+
+    template <uint32_t Offset, uint32_t Length, bool Fold>
+    static bool equals(const char *at)
+    {
+        if constexpr (!Fold)
+        {
+            return std::memcmp(at, Source + Offset, Length) == 0;
+        }
+        else
+        {
+            for (uint32_t i = 0; i < Length; i++)
+            {
+                if (foldByte(at[i]) != foldByte(Source[Offset + i]))
+                    return false;
+            }
+            return true;
+        }
+    }
+
+    template <uint32_t Child, uint32_t End, bool Ignore>
+    static bool evaluateChildren(Context &ctx)
+    {
+        if constexpr (Child >= End)
+        {
+            return true;
+        }
+        else
+        {
+            if (!evaluate<Child, Ignore>(ctx))
+            {
+                return false;
+            }
+            return evaluateChildren<tree.nodes[Child].end, End, Ignore>(ctx);
+        }
+    }
+
+    template <uint32_t Node, bool Ignore>
+    static bool evaluate(Context &ctx)
+    {
+        constexpr Tree::Node n = tree.nodes[Node];
+        if constexpr (n.kind == Tree::Kind::String)
+        {
+            if (ctx.currentChar >= ctx.text.size() || ctx.text.size() - ctx.currentChar < n.length)
+            {
+                return false;
+            }
+            if (!equals<n.value, n.length, Ignore>(ctx.text.data() + ctx.currentChar))
+            {
+                return false;
+            }
+            ctx.currentChar += n.length;
+            return true;
+        }
+        else if constexpr (n.kind == Tree::Kind::Wildcard)
+        {
+            if (ctx.currentChar >= ctx.text.size())
+            {
+                return false;
+            }
+            ctx.currentChar++;
+            return true;
+        }
+        else if constexpr (n.kind == Tree::Kind::Many)
+        {
+            if (!evaluate<Node + 1, Ignore>(ctx))
+            {
+                return false;
+            }
+            if constexpr (tree.nodes[Node + 1].kind == Tree::Kind::Wildcard)
+            {
+                ctx.currentChar = ctx.text.size();
+                return true;
+            }
+            else
+            {
+                char c = ctx.text[ctx.currentChar - 1];
+                size_t run = runLength(ctx.text.data() + ctx.currentChar, ctx.text.size() - ctx.currentChar, c);
+                if (run == 0)
+                {
+                    return false;
+                }
+                ctx.currentChar += run;
+                return true;
+            }
+        }
+        else if constexpr (n.kind == Tree::Kind::Counter)
+        {
+            constexpr int count = static_cast<int>(n.value);
+            if (!evaluate<Node + 1, Ignore>(ctx))
+            {
+                return false;
+            }
+            if constexpr (tree.nodes[Node + 1].kind == Tree::Kind::Wildcard)
+            {
+                if (ctx.currentChar + count - 1 > ctx.text.size())
+                {
+                    return false;
+                }
+                ctx.currentChar += count - 1;
+                return true;
+            }
+            else
+            {
+                char c = ctx.text[ctx.currentChar - 1];
+                if (ctx.text.size() - ctx.currentChar < static_cast<size_t>(count) ||
+                    runLength(ctx.text.data() + ctx.currentChar, count, c) != static_cast<size_t>(count))
+                {
+                    return false;
+                }
+                ctx.currentChar += count;
+                return true;
+            }
+        }
+        else if constexpr (n.kind == Tree::Kind::Or)
+        {
+            size_t checkpoint = ctx.currentChar;
+            bool lhsSuccsess = evaluate<Node + 1, Ignore>(ctx);
+            size_t lhsEnd = ctx.currentChar;
+            ctx.currentChar = checkpoint;
+            bool rhsSuccess = evaluate<tree.nodes[Node + 1].end, Ignore>(ctx);
+            size_t rhsEnd = ctx.currentChar;
+            if (lhsSuccsess == rhsSuccess)
+            {
+                ctx.currentChar = lhsEnd > rhsEnd ? lhsEnd : rhsEnd;
+                return lhsSuccsess;
+            }
+            ctx.currentChar = lhsSuccsess ? lhsEnd : rhsEnd;
+            return true;
+        }
+        else if constexpr (n.kind == Tree::Kind::Group)
+        {
+            size_t start = ctx.currentChar;
+            if (!evaluateChildren<Node + 1, n.end, Ignore>(ctx))
+            {
+                return false;
+            }
+            if constexpr (isSelected(n.value))
+            {
+                ctx.indexes[n.value] = {start, ctx.currentChar};
+            }
+            return true;
+        }
+        else if constexpr (n.kind == Tree::Kind::Ignore)
+        {
+            return evaluateChildren<Node + 1, n.end, true>(ctx);
+        }
+        else if constexpr (n.kind == Tree::Kind::GroupSelector)
+        {
+            if (!evaluateChildren<Node + 1, n.end, Ignore>(ctx))
+            {
+                return false;
+            }
+            if constexpr (n.value != 0)
+            {
+                if (ctx.indexes[n.value].start == std::string::npos)
+                {
+                    return false;
+                }
+                ctx.startingChar = ctx.indexes[n.value].start;
+                ctx.currentChar = ctx.indexes[n.value].end;
+            }
+            return true;
+        }
+        else
+        {
+            return evaluateChildren<Node + 1, n.end, Ignore>(ctx);
+        }
+    }
+
+    static bool evaluateSliding(Context &ctx)
+    {
+        for (size_t start = ctx.startingChar; !evaluate<0, false>(ctx);)
+        {
+            ctx.currentChar = ctx.startingChar = ++start;
+            if (ctx.startingChar >= ctx.text.size())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool evaluateAnchored(Context &ctx)
+    {
+        ctx.startingChar = ctx.currentChar;
+        return evaluate<0, false>(ctx);
+    }
+
+public:
+    // Same contract, and the same results, as Pattern::find() with the tree
+    // engine.
+    static bool find(std::string_view text, size_t from, size_t &start, size_t &end)
+    {
+        Context ctx;
+        while (from <= text.size())
+        {
+            size_t recordEnd = std::min(text.find(recordSeparator, from), text.size());
+            ctx.text = text.substr(0, recordEnd);
+            if constexpr (leading != 0)
+            {
+                auto &filter = prefilter();
+                for (size_t at = from; (at = filter.find(ctx.text, at)) != std::string::npos; at++)
+                {
+                    ctx.currentChar = at;
+                    if (evaluateAnchored(ctx))
+                    {
+                        start = ctx.startingChar;
+                        end = ctx.currentChar;
+                        return true;
+                    }
+                }
+            }
+            else if (from < recordEnd)
+            {
+                ctx.currentChar = ctx.startingChar = from;
+                if (evaluateSliding(ctx))
+                {
+                    start = ctx.startingChar;
+                    end = ctx.currentChar;
+                    return true;
+                }
+            }
+            from = recordEnd + 1;
+        }
+        return false;
+    }
+};
+
+// Whether text holds a match of Source anywhere.
+template <const char *Source>
+bool match(std::string_view text)
+{
+    size_t start, end;
+    return StaticPattern<Source>::find(text, 0, start, end);
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "pattern.hpp"
+#include "asyncReader.hpp"
+
+// Scans a run of complete records and reports each record holding a match
+// as onRecord(record, offset, spans), spans relative to the record. spans is
+// scratch space owned by the caller so it can be reused between calls.
+template <typename OnRecord>
+bool scanRecords(const Pattern &pattern, MatchContext &ctx, std::string_view records, uint64_t offset,
+                 std::vector<Span> &spans, OnRecord &onRecord)
+{
+    bool matched = false;
+    size_t recordStart = std::string::npos;
+    size_t from = 0;
+    size_t previousEnd = 0;
+    size_t start, end;
+
+    auto flush = [&]()
+    {
+        if (recordStart == std::string::npos)
+            return;
+        auto nl = records.find(recordSeparator, recordStart);
+        auto record = records.substr(recordStart, nl == std::string::npos ? std::string::npos : nl - recordStart);
+        onRecord(record, offset + recordStart, spans);
+        spans.clear();
+    };
+
+    // Past the last byte there is no record left, only the empty position
+    // after its '\n'.
+    while (from < records.size() && pattern.find(ctx, records, from, start, end))
+    {
+        matched = true;
+        // Only the bytes since the previous match can hold a '\n'. That
+        // includes the byte at its end, which an empty match sits on.
+        size_t searched = std::min(previousEnd, start);
+        auto nl = records.substr(searched, start - searched).rfind(recordSeparator);
+        if (recordStart == std::string::npos)
+        {
+            auto previous = start == 0 ? std::string::npos : records.rfind(recordSeparator, start - 1);
+            recordStart = previous == std::string::npos ? 0 : previous + 1;
+        }
+        else if (nl != std::string::npos)
+        {
+            flush();
+            recordStart = searched + nl + 1;
+        }
+        spans.push_back({start - recordStart, end - recordStart});
+        previousEnd = end;
+        from = std::max(end, start + 1);
+    }
+    flush();
+    return matched;
+}
+
+// Number of records in records holding a match, up to limit. Only whether a
+// record matches matters, so the search moves on to the next record at its
+// first match and never resolves \O{n} groups.
+size_t countRecords(const Pattern &pattern, MatchContext &ctx, std::string_view records,
+                    size_t limit = std::string::npos)
+{
+    size_t count = 0;
+    size_t from = 0;
+    size_t start;
+    while (count < limit && from < records.size() && pattern.findStart(ctx, records, from, start))
+    {
+        count++;
+        size_t nl = records.find(recordSeparator, start);
+        if (nl == std::string::npos)
+            break;
+        from = nl + 1;
+    }
+    return count;
+}
+
+// Reads a byte stream one fixed-size chunk at a time into a single reused
+// buffer and hands out runs of complete '\n'-terminated records. The
+// partial record at the end of a chunk is carried to the front of the
+// buffer and finished by the next read, so peak memory is the chunk size
+// plus the longest line, whatever the input size.
+class RecordReader
+{
+private:
+    std::vector<char> buffer;
+    size_t chunkSize;
+
+public:
+    static const size_t defaultChunkSize = 1 << 20;
+
+    RecordReader(size_t chunkSize = defaultChunkSize) : buffer(chunkSize), chunkSize(chunkSize)
+    {
+    }
+
+    // Calls onRecords(records, offset) until fd is exhausted or it returns
+    // false; the last run may lack its trailing '\n'. Returns false on a
+    // read error.
+    template <typename OnRecords>
+    bool read(int fd, OnRecords onRecords)
+    {
+        uint64_t offset = 0;
+        size_t filled = 0;
+
+        while (true)
+        {
+            if (buffer.size() - filled < chunkSize)
+                buffer.resize(filled + chunkSize);
+
+            ssize_t n = ::read(fd, buffer.data() + filled, chunkSize);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            if (n == 0)
+                break;
+
+            filled += n;
+
+            auto data = std::string_view(buffer.data(), filled);
+            auto last = data.rfind(recordSeparator);
+            if (last == std::string::npos)
+                continue;
+            size_t complete = last + 1;
+            if (!onRecords(data.substr(0, complete), offset))
+                return true;
+
+            std::memmove(buffer.data(), buffer.data() + complete, filled - complete);
+            filled -= complete;
+            offset += complete;
+        }
+
+        if (filled > 0)
+            onRecords(std::string_view(buffer.data(), filled), offset);
+
+        return true;
+    }
+};
+
+enum struct InputBackend
+{
+    Auto,
+    Uring,
+    Threads,
+    Read
+};
+
+// Reads records the way backend says, with the same calls as RecordReader.
+// A regular file is read ahead of the matcher, through io_uring where the
+// kernel allows it and on a prefetching thread otherwise, so that neither
+// the disk nor the matcher waits for the other. Pipes and terminals, and
+// Read, go through a RecordReader: reading ahead of them could block on
+// input nobody asked for yet.
+class InputReader
+{
+private:
+    InputBackend backend;
+    RecordJoiner joiner;
+    std::unique_ptr<RecordReader> records;
+    std::unique_ptr<UringReader> uring;
+    std::unique_ptr<PrefetchReader> prefetch;
+
+public:
+    InputReader(InputBackend backend = InputBackend::Auto) : backend(backend)
+    {
+    }
+
+    template <typename OnRecords>
+    bool read(int fd, OnRecords onRecords)
+    {
+        struct stat st;
+        off_t offset = backend == InputBackend::Read || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+                           ? -1
+                           : lseek(fd, 0, SEEK_CUR);
+        if (offset < 0)
+        {
+            if (!records)
+                records = std::make_unique<RecordReader>();
+            return records->read(fd, onRecords);
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (backend != InputBackend::Threads)
+        {
+            if (!uring)
+                uring = std::make_unique<UringReader>();
+            if (uring->available())
+                return uring->read(fd, offset, joiner, onRecords);
+        }
+        if (!prefetch)
+            prefetch = std::make_unique<PrefetchReader>();
+        return prefetch->read(fd, offset, joiner, onRecords);
+    }
+};
+
+// Runs a pattern over an unbounded byte stream through an InputReader.
+// Matches never cross a '\n', so the carried partial record is the only
+// lookback a pending match can need.
+class StreamScanner
+{
+private:
+    const Pattern &pattern;
+    MatchContext &ctx;
+    InputReader reader;
+    std::vector<Span> spans;
+
+public:
+    StreamScanner(const Pattern &pattern, MatchContext &ctx, InputBackend backend = InputBackend::Auto)
+        : pattern(pattern), ctx(ctx), reader(backend)
+    {
+    }
+
+    // Reads fd to the end. onRecord(record, offset, spans) is called once for
+    // every line holding a match, spans relative to the line. Returns
+    // whether anything matched; read errors are reported through ok.
+    template <typename OnRecord>
+    bool scan(int fd, OnRecord onRecord, bool &ok)
+    {
+        bool matched = false;
+        ok = reader.read(fd, [&](std::string_view records, uint64_t offset)
+                         {
+                             matched |= scanRecords(pattern, ctx, records, offset, spans, onRecord);
+                             return true; });
+        return matched;
+    }
+
+    // Reads fd and returns the number of lines holding a match, or stops at
+    // the first one with stopAtFirst. Read errors are reported through ok.
+    uint64_t count(int fd, bool &ok, bool stopAtFirst = false)
+    {
+        uint64_t count = 0;
+        ok = reader.read(fd, [&](std::string_view records, uint64_t)
+                         {
+                             count += countRecords(pattern, ctx, records, stopAtFirst ? 1 : std::string::npos);
+                             return !stopAtFirst || count == 0; });
+        return count;
+    }
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <vector>
 
@@ -19,8 +20,17 @@ struct Token
         String
     };
 
-    std::string value;
+    // Slice of the pattern the token was read from, which must outlive it.
+    std::string_view value;
     Type type;
+    size_t offset;
+};
+
+// Why a pattern was rejected, and the offset in it where that was noticed.
+struct PatternError
+{
+    size_t offset = 0;
+    std::string message;
 };
 
 std::ostream &operator<<(std::ostream &os, Token token)
@@ -61,115 +71,136 @@ std::ostream &operator<<(std::ostream &os, Token token)
     return os;
 }
 
+// Splits a pattern into tokens that point into it, so the only allocation is
+// the token vector itself. A malformed pattern stops the tokenizer at the
+// first error, which getError() describes.
 class Tokenizer
 {
 private:
     std::vector<Token> _token;
-    std::string createBasicToken(std::vector<Token> &vec, std::string t, Token::Type type)
+    PatternError error;
+    bool failed = false;
+
+    // Ends the pending string at at and adds a token of type for the
+    // character there. Returns where the next string starts.
+    size_t createBasicToken(std::vector<Token> &vec, std::string_view input, size_t start, size_t at, Token::Type type)
+    {
+        if (at > start)
+            vec.push_back({.value = input.substr(start, at - start), .type = Token::Type::String, .offset = start});
+        vec.push_back({.value = {}, .type = type, .offset = at});
+        return at + 1;
+    }
+
+    // The digits of a {n} whose '{' is at open. Returns the index of the '}',
+    // or npos when there is none.
+    size_t readBraces(std::vector<Token> &vec, std::string_view input, size_t open, size_t tokenStart, Token::Type type)
     {
-        if (t != "")
-            vec.push_back({.value = t, .type = Token::Type::String});
-        vec.push_back({.value = "", .type = type});
-        return "";
+        size_t close = input.find('}', open + 1);
+        if (close == std::string_view::npos)
+        {
+            fail(open, "missing '}'");
+            return close;
+        }
+        vec.push_back({.value = input.substr(open + 1, close - open - 1), .type = type, .offset = tokenStart});
+        return close;
     }
 
-    std::vector<Token> tokenize(std::string input)
+    void fail(size_t offset, std::string message)
+    {
+        failed = true;
+        error = {offset, std::move(message)};
+    }
+
+    std::vector<Token> tokenize(std::string_view input)
     {
         std::vector<Token> tokens;
-        std::string t = "";
-        for (int i = 0; i < input.length(); i++)
+        // Every token covers at least one character.
+        tokens.reserve(input.size());
+        size_t start = 0;
+        for (size_t i = 0; i < input.length() && !failed; i++)
         {
             switch (input[i])
             {
             case '*':
-                t = createBasicToken(tokens, t, Token::Type::Many);
+                start = createBasicToken(tokens, input, start, i, Token::Type::Many);
                 break;
             case '.':
-                t = createBasicToken(tokens, t, Token::Type::Wildcard);
+                start = createBasicToken(tokens, input, start, i, Token::Type::Wildcard);
                 break;
             case '+':
-                t = createBasicToken(tokens, t, Token::Type::Or);
+                start = createBasicToken(tokens, input, start, i, Token::Type::Or);
                 break;
             case '(':
-                t = createBasicToken(tokens, t, Token::Type::OpenParan);
+                start = createBasicToken(tokens, input, start, i, Token::Type::OpenParan);
                 break;
             case ')':
-                t = createBasicToken(tokens, t, Token::Type::CloseParan);
+                start = createBasicToken(tokens, input, start, i, Token::Type::CloseParan);
                 break;
             case '{':
-                if (t != "")
-                    tokens.push_back({.value = t, .type = Token::Type::String});
-                t = "";
-                i++;
-                while (input[i] != '}')
-                {
-                    if (i == 1 - input.length())
-                    {
-                        std::exit(EXIT_FAILURE);
-                    }
-                    t += input[i];
-                    i++;
-                }
-                tokens.push_back({.value = t, .type = Token::Type::Counter});
-                t = "";
+                if (i > start)
+                    tokens.push_back({.value = input.substr(start, i - start), .type = Token::Type::String, .offset = start});
+                i = readBraces(tokens, input, i, i, Token::Type::Counter);
+                start = i + 1;
                 break;
 
             case '\\':
-                if (t != "")
-                    tokens.push_back({.value = t, .type = Token::Type::String});
-                t = "";
+            {
+                if (i > start)
+                    tokens.push_back({.value = input.substr(start, i - start), .type = Token::Type::String, .offset = start});
 
-                i++;
-                if (input[i] == 'O')
+                size_t escape = i++;
+                if (i < input.length() && input[i] == 'O')
                 {
                     i++;
-                    if (input[i] != '{')
-                        std::exit(EXIT_FAILURE);
-                    i++;
-                    while (input[i] != '}')
+                    if (i >= input.length() || input[i] != '{')
                     {
-                        if (i == 1 - input.length())
-                        {
-                            std::exit(EXIT_FAILURE);
-                        }
-                        t += input[i];
-                        i++;
+                        fail(i, "expected '{' after \\O");
+                        break;
                     }
-                    tokens.push_back({.value = t, .type = Token::Type::GroupSelector});
-                    t = "";
+                    i = readBraces(tokens, input, i, escape, Token::Type::GroupSelector);
                 }
-                else if (input[i] == 'I')
+                else if (i < input.length() && input[i] == 'I')
                 {
-                    tokens.push_back({.value = t, .type = Token::Type::Ignore});
-                    t = "";
+                    tokens.push_back({.value = {}, .type = Token::Type::Ignore, .offset = escape});
                 }
                 else
                 {
-                    std::exit(EXIT_FAILURE);
+                    fail(escape, "unknown escape, expected \\I or \\O{n}");
                 }
-
+                start = i + 1;
                 break;
+            }
 
             default:
-                t += input[i];
                 break;
             }
         }
 
-        if (t != "")
-            tokens.push_back({.value = t, .type = Token::Type::String});
+        if (input.length() > start && !failed)
+            tokens.push_back({.value = input.substr(start), .type = Token::Type::String, .offset = start});
 
         return tokens;
     }
 
 public:
-    Tokenizer(std::string input)
+    Tokenizer(std::string_view input)
     {
         _token = tokenize(input);
     }
 
-    std::vector<Token> getTokens()
+    bool ok() const
+    {
+        return !failed;
+    }
+
+    const PatternError &getError() const
+    {
+        return error;
+    }
+
+    // Hands the tokens over; the tokenizer is empty afterwards.
+    std::vector<Token> takeTokens()
     {
-        return _token;
+        return std::move(_token);
     }
 };
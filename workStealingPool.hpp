@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <algorithm>
+
+// Runs tasks 0 to count - 1 as run(worker, task) on up to threads workers.
+// Each worker is dealt every threads-th task and takes its own oldest
+// first, so the pool as a whole moves through the tasks roughly in order.
+// A worker whose queue runs dry steals the newest task of another, so a
+// few slow tasks don't leave the rest of the workers idle. No task is added
+// once the pool has started, so a worker that finds every queue empty is
+// done.
+class WorkStealingPool
+{
+private:
+    // Aligned so that workers taking from neighbouring queues don't share a
+    // cache line.
+    struct alignas(64) Queue
+    {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+
+    std::unique_ptr<Queue[]> queues;
+    unsigned threads;
+
+    bool take(unsigned worker, size_t &task)
+    {
+        {
+            Queue &own = queues[worker];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty())
+            {
+                task = own.tasks.front();
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        for (unsigned i = 1; i < threads; i++)
+        {
+            Queue &victim = queues[(worker + i) % threads];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    WorkStealingPool(size_t count, unsigned threads)
+        : queues(new Queue[std::max(1u, threads)]), threads(std::max(1u, threads))
+    {
+        for (size_t task = 0; task < count; task++)
+            queues[task % this->threads].tasks.push_back(task);
+    }
+
+    unsigned size() const
+    {
+        return threads;
+    }
+
+    // Returns once every task has run. Worker 0 is the calling thread.
+    template <typename Run>
+    void run(Run run)
+    {
+        auto work = [&](unsigned worker)
+        {
+            size_t task;
+            while (take(worker, task))
+                run(worker, task);
+        };
+        std::vector<std::thread> workers;
+        for (unsigned worker = 1; worker < threads; worker++)
+            workers.emplace_back(work, worker);
+        work(0);
+        for (auto &w : workers)
+            w.join();
+    }
+};